@@ -0,0 +1,390 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <filesystem>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include "quadtree.h"
+#include "lineartree.h"
+#include "simd.h"
+
+using namespace std;
+
+// Per-stage timings of the compression pipeline, separate from the CLI so
+// that prompting, decoding and encoding do not blur together.
+//
+//   benchmark [--runs N] [--synthetic 1,4,16] [--json FILE] [paths...]
+//
+// paths are image files or directories (default: test/). Every stage is
+// run --runs times and the minimum and median are reported; synthetic
+// images use a fixed seed, so two runs measure the same work. The SIMD
+// pixel kernels are checked against the scalar ones and the linear tree
+// against the pointer tree it is made from; a mismatch makes the exit
+// status 1.
+
+struct BenchOptions {
+    int runs = 3;
+    vector<double> syntheticMegapixels = {1, 4, 16};
+    string jsonPath = "";
+    vector<string> paths;
+};
+
+struct BenchResult {
+    string image;
+    int width, height;
+    string stage;
+    int method; // 0 when the stage has none
+    double minMs, medianMs;
+    double megapixels; // Pixels processed per run, for throughput
+};
+
+static const char* METHOD_NAMES[] = {"", "variance", "mad", "maxdiff", "entropy"};
+static const double DEFAULT_THRESHOLDS[] = {0, 10.0, 5.0, 20.0, 0.5};
+static const int MIN_BLOCK = 2;
+
+// Run f `runs` times and keep the minimum and median wall time
+template <typename F>
+static void timeRuns(int runs, F f, double& minMs, double& medianMs) {
+    vector<double> times;
+    for (int i = 0; i < runs; i++) {
+        auto start = chrono::steady_clock::now();
+        f();
+        times.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    sort(times.begin(), times.end());
+    minMs = times.front();
+    medianMs = times[times.size() / 2];
+}
+
+static bool isImagePath(const filesystem::path& path) {
+    string extension = path.extension().string();
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension == ".jpg" || extension == ".jpeg" || extension == ".png" || extension == ".bmp" ||
+           extension == ".ppm" || extension == ".pam";
+}
+
+static int rootSize(const Image& image) {
+    int size = 1;
+    while (size < max(image.width(), image.height())) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Deterministic test images: white noise, a diagonal gradient, a flat color
+static Image syntheticImage(const string& kind, double megapixels) {
+    int side = (int)sqrt(megapixels * 1e6);
+    Image image(side, side);
+    mt19937 random(12345);
+    for (int y = 0; y < side; y++) {
+        Pixel* row = image.row(y);
+        for (int x = 0; x < side; x++) {
+            if (kind == "noise") {
+                uint32_t bits = random();
+                row[x] = Pixel{(unsigned char)bits, (unsigned char)(bits >> 8), (unsigned char)(bits >> 16)};
+            } else if (kind == "gradient") {
+                row[x] = Pixel{(unsigned char)(x * 255 / side), (unsigned char)(y * 255 / side), (unsigned char)((x + y) * 127 / side)};
+            } else {
+                row[x] = Pixel{90, 140, 200};
+            }
+        }
+    }
+    return image;
+}
+
+// Color of the pointer tree's leaf covering (x, y), for checking colorAt
+static Pixel pointerColorAt(const QuadTreeNode* node, int x, int y) {
+    while (!node->isLeaf) {
+        int halfSize = node->size / 2;
+        int quadrant = (x >= node->x + halfSize ? 1 : 0) + (y >= node->y + halfSize ? 2 : 0);
+        node = node->children[quadrant];
+    }
+    return node->avgColor;
+}
+
+static bool sameImage(const Image& a, const Image& b) {
+    if (a.width() != b.width() || a.height() != b.height()) return false;
+    for (int y = 0; y < a.height(); y++) {
+        if (memcmp(a.row(y), b.row(y), a.width() * sizeof(Pixel)) != 0) return false;
+    }
+    return true;
+}
+
+// The linear tree must describe the same image as the pointer tree it was
+// made from: same pixels (whole and cut at a depth), depth and point lookups
+static bool checkLinearTree(const QuadTree& tree, const LinearQuadTree& linear, const Image& reference) {
+    Image output(reference.width(), reference.height());
+    linear.reconstruct(output);
+    if (!sameImage(output, reference) || linear.depth() != tree.stats.depth || linear.nodeCount() != tree.stats.nodes) {
+        return false;
+    }
+
+    const int cut = tree.stats.depth / 2;
+    Image pointerCut(reference.width(), reference.height()), linearCut(reference.width(), reference.height());
+    reconstructImage(tree.root, pointerCut, cut);
+    linear.reconstruct(linearCut, cut);
+    if (!sameImage(pointerCut, linearCut)) return false;
+
+    mt19937 random(54321);
+    for (int i = 0; i < 10000; i++) {
+        int x = random() % reference.width(), y = random() % reference.height();
+        Pixel a = linear.colorAt(x, y), b = pointerColorAt(tree.root, x, y);
+        if (a.r != b.r || a.g != b.g || a.b != b.b) return false;
+    }
+    return true;
+}
+
+static bool linearMismatch = false;
+
+// One block through a kernel set, every result folded into one array
+static vector<uint64_t> runKernels(const PixelKernels& kernels, const Pixel* p, size_t stride, int width, int rows, Pixel center) {
+    uint64_t sum[3] = {1, 2, 3}, sumSq[3] = {4, 5, 6}, sad[3] = {7, 8, 9}, squaresSum[3] = {0, 0, 0};
+    unsigned char minValue[3] = {200, 255, 90}, maxValue[3] = {10, 0, 160}; // Folded in, as after an earlier run
+    kernels.sum(p, stride, width, rows, sum);
+    kernels.sumSquares(p, stride, width, rows, squaresSum, sumSq);
+    kernels.minMax(p, stride, width, rows, minValue, maxValue);
+    kernels.absDiff(p, stride, width, rows, center, sad);
+    vector<uint64_t> out(sum, sum + 3);
+    out.insert(out.end(), squaresSum, squaresSum + 3);
+    out.insert(out.end(), sumSq, sumSq + 3);
+    out.insert(out.end(), sad, sad + 3);
+    out.insert(out.end(), minValue, minValue + 3);
+    out.insert(out.end(), maxValue, maxValue + 3);
+    return out;
+}
+
+// The SIMD kernels must give exactly what the scalar ones do. Blocks take
+// every width around the vector sizes plus some long rows, packed, odd and
+// padded strides, starts at every byte offset, and random, saturated
+// (all 255) and empty (all 0) pixels.
+static bool checkPixelKernels() {
+    const vector<const PixelKernels*> kernels = supportedPixelKernels();
+    const PixelKernels& reference = scalarPixelKernels();
+    mt19937 random(777);
+    vector<unsigned char> buffer(1 << 20);
+
+    size_t blocks = 0;
+    bool match = true;
+    for (int fill = 0; fill < 3; fill++) {
+        for (unsigned char& byte : buffer) {
+            byte = fill == 0 ? (unsigned char)random() : fill == 1 ? 255 : 0;
+        }
+        for (int width = 1; width <= 300 && match; width += width < 72 ? 1 : 37) {
+            for (int padding : {0, 1, 2, 5, 64}) {
+                const size_t stride = (size_t)width * 3 + padding;
+                const int offset = random() % 64;
+                for (int rows : {1, 2, 3, 7, 16, 33}) {
+                    if (offset + stride * rows > buffer.size()) continue;
+                    const Pixel* p = reinterpret_cast<const Pixel*>(buffer.data() + offset);
+                    Pixel center = {(unsigned char)random(), (unsigned char)random(), (unsigned char)random()};
+                    vector<uint64_t> expected = runKernels(reference, p, stride, width, rows, center);
+                    for (const PixelKernels* candidate : kernels) {
+                        if (runKernels(*candidate, p, stride, width, rows, center) != expected) {
+                            cerr << "Error: " << candidate->name << " kernels differ from scalar at width " << width
+                                 << ", stride " << stride << ", rows " << rows << ", offset " << offset << endl;
+                            match = false;
+                        }
+                    }
+                    blocks++;
+                }
+            }
+        }
+    }
+
+    cout << "Pixel kernels:";
+    for (const PixelKernels* candidate : kernels) cout << " " << candidate->name;
+    cout << (match ? " match scalar on " : " checked on ") << blocks << " blocks" << endl;
+    return match;
+}
+
+// Every stage after decoding, for one image
+static void benchImage(const BenchOptions& options, const string& name, const Image& image, vector<BenchResult>& results) {
+    const int size = rootSize(image);
+    const double megapixels = (double)image.width() * image.height() / 1e6;
+    auto record = [&](const string& stage, int method, double pixels, double minMs, double medianMs) {
+        results.push_back(BenchResult{name, image.width(), image.height(), stage, method, minMs, medianMs, pixels});
+        cout << "  " << left << setw(12) << stage << setw(10) << METHOD_NAMES[method] << right << fixed << setprecision(2)
+             << setw(10) << minMs << " ms min " << setw(10) << medianMs << " ms median "
+             << setw(9) << (pixels / (minMs / 1000.0)) << " MP/s" << endl;
+    };
+
+    double minMs, medianMs;
+    for (int method = 1; method <= 4; method++) {
+        // Metric: every block of every level down to MIN_BLOCK, pixels read straight from the image
+        int levels = 0;
+        timeRuns(options.runs, [&]() {
+            levels = 0;
+            for (int block = size; block >= MIN_BLOCK; block /= 2, levels++) {
+                for (int y = 0; y < image.height(); y += block) {
+                    for (int x = 0; x < image.width(); x += block) {
+                        Pixel avg;
+                        calculateAvgColorAndError(image, x, y, block, method, avg);
+                    }
+                }
+            }
+        }, minMs, medianMs);
+        record("metric", method, megapixels * levels, minMs, medianMs);
+
+        // The build times include the tables only for the methods that read them
+        IntegralImage integral;
+        const bool useIntegral = usesIntegralImage(method);
+        if (useIntegral) {
+            timeRuns(options.runs, [&]() { integral = buildIntegralImage(image, method == 1, method == 3); }, minMs, medianMs);
+            record("integral", method, megapixels, minMs, medianMs);
+        }
+
+        QuadTree tree;
+        timeRuns(options.runs, [&]() {
+            tree.build(image, size, DEFAULT_THRESHOLDS[method], MIN_BLOCK, method, useIntegral ? &integral : nullptr);
+        }, minMs, medianMs);
+        record("build", method, megapixels, minMs, medianMs);
+
+        timeRuns(options.runs, [&]() {
+            tree.buildBottomUp(image, size, DEFAULT_THRESHOLDS[method], MIN_BLOCK, method);
+        }, minMs, medianMs);
+        record("bottom-up", method, megapixels, minMs, medianMs);
+
+        if (method != 1) continue;
+
+        // Output stages on the Variance tree
+        Image output(image.width(), image.height());
+        timeRuns(options.runs, [&]() { reconstructImage(tree.root, output); }, minMs, medianMs);
+        record("reconstruct", 0, megapixels, minMs, medianMs);
+
+        // The same through the pointer-free layout
+        LinearQuadTree linear;
+        timeRuns(options.runs, [&]() { linear = LinearQuadTree::fromTree(tree.root, image.width(), image.height()); }, minMs, medianMs);
+        record("linearize", 0, megapixels, minMs, medianMs);
+        Image linearOutput(image.width(), image.height());
+        timeRuns(options.runs, [&]() { linear.reconstruct(linearOutput); }, minMs, medianMs);
+        record("linear-recon", 0, megapixels, minMs, medianMs);
+        cout << "  nodes " << linear.nodeCount() << ": linear " << linear.bytes() << " bytes, pointer "
+             << tree.stats.nodes * sizeof(QuadTreeNode) << " bytes" << endl;
+        if (!checkLinearTree(tree, linear, output)) {
+            cerr << "Error: the linear tree of " << name << " differs from its pointer tree" << endl;
+            linearMismatch = true;
+        }
+
+        const string outputBase = (filesystem::temp_directory_path() / "quadtree_bench").string();
+        timeRuns(options.runs, [&]() { saveQuadTreeImage(outputBase + ".png", output); }, minMs, medianMs);
+        record("save-png", 0, megapixels, minMs, medianMs);
+        timeRuns(options.runs, [&]() { saveQuadTreeImage(outputBase + ".jpg", output); }, minMs, medianMs);
+        record("save-jpg", 0, megapixels, minMs, medianMs);
+        filesystem::remove(outputBase + ".png");
+        filesystem::remove(outputBase + ".jpg");
+    }
+}
+
+static string jsonString(const string& value) {
+    string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static bool writeJson(const string& path, const BenchOptions& options, const vector<BenchResult>& results) {
+    ofstream file(path);
+    if (!file) return false;
+
+    file << "{\n  \"runs\": " << options.runs << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        file << "    {\"image\": " << jsonString(r.image) << ", \"width\": " << r.width << ", \"height\": " << r.height
+             << ", \"stage\": " << jsonString(r.stage) << ", \"method\": " << jsonString(METHOD_NAMES[r.method])
+             << fixed << setprecision(3) << ", \"min_ms\": " << r.minMs << ", \"median_ms\": " << r.medianMs
+             << ", \"mp_per_s\": " << r.megapixels / (r.minMs / 1000.0) << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    file << "  ]\n}\n";
+    return file.good();
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--runs" && hasValue) {
+            options.runs = max(1, atoi(argv[++i]));
+        } else if (arg == "--json" && hasValue) {
+            options.jsonPath = argv[++i];
+        } else if (arg == "--synthetic" && hasValue) {
+            // Comma separated sizes in megapixels, "" or 0 for none
+            options.syntheticMegapixels.clear();
+            stringstream list(argv[++i]);
+            string item;
+            while (getline(list, item, ',')) {
+                double megapixels = atof(item.c_str());
+                if (megapixels > 0) options.syntheticMegapixels.push_back(megapixels);
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            cout << "Usage: " << argv[0] << " [--runs N] [--synthetic MP,MP,...] [--json FILE] [image or directory...]" << endl;
+            return 0;
+        } else {
+            options.paths.push_back(arg);
+        }
+    }
+    if (options.paths.empty()) {
+        options.paths.push_back("test");
+    }
+
+    // Expand directories, in a stable order
+    vector<string> files;
+    for (const string& path : options.paths) {
+        error_code error;
+        if (filesystem::is_directory(path, error)) {
+            vector<string> found;
+            for (const auto& entry : filesystem::directory_iterator(path)) {
+                if (entry.is_regular_file() && isImagePath(entry.path())) found.push_back(entry.path().string());
+            }
+            sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        } else {
+            files.push_back(path);
+        }
+    }
+
+    const bool kernelsMatch = checkPixelKernels();
+
+    vector<BenchResult> results;
+    for (const string& file : files) {
+        Image image;
+        double minMs, medianMs;
+        timeRuns(options.runs, [&]() { image = loadImage(file); }, minMs, medianMs);
+        if (image.empty()) {
+            cerr << "Error: Could not load image " << file << endl;
+            continue;
+        }
+
+        cout << file << " (" << image.width() << "x" << image.height() << ")" << endl;
+        double megapixels = (double)image.width() * image.height() / 1e6;
+        results.push_back(BenchResult{file, image.width(), image.height(), "decode", 0, minMs, medianMs, megapixels});
+        cout << "  " << left << setw(22) << "decode" << right << fixed << setprecision(2) << setw(10) << minMs << " ms min "
+             << setw(10) << medianMs << " ms median " << setw(9) << megapixels / (minMs / 1000.0) << " MP/s" << endl;
+        benchImage(options, file, image, results);
+    }
+
+    for (double megapixels : options.syntheticMegapixels) {
+        for (const string kind : {"noise", "gradient", "flat"}) {
+            Image image = syntheticImage(kind, megapixels);
+            ostringstream name;
+            name << kind << "-" << megapixels << "mp";
+            cout << name.str() << " (" << image.width() << "x" << image.height() << ")" << endl;
+            benchImage(options, name.str(), image, results);
+        }
+    }
+
+    if (!options.jsonPath.empty() && !writeJson(options.jsonPath, options, results)) {
+        cerr << "Error: Could not write " << options.jsonPath << endl;
+        return 1;
+    }
+    return linearMismatch || !kernelsMatch ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+using namespace std;
+
+// Bump allocator for many small objects of one type. Objects are carved out
+// of large blocks and are never freed individually: reset() drops them all
+// in O(1) and keeps the blocks, so the next tree reuses the same memory.
+// T must be trivially destructible because destructors are never run.
+template <typename T>
+class Arena {
+    static_assert(is_trivially_destructible<T>::value, "Arena objects are never destroyed individually");
+
+public:
+    explicit Arena(size_t objectsPerBlock = 16384) : objectsPerBlock_(objectsPerBlock) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (blockIndex_ == blocks_.size() || used_ == objectsPerBlock_) {
+            nextBlock();
+        }
+        void* slot = &blocks_[blockIndex_][used_++];
+        count_++;
+        return new (slot) T(forward<Args>(args)...);
+    }
+
+    // Forget every object but keep the blocks for reuse
+    void reset() {
+        blockIndex_ = 0;
+        used_ = 0;
+        count_ = 0;
+    }
+
+    // Position of the next allocation. rewind() forgets every object created
+    // after the mark was taken, so a subtree built speculatively can be dropped
+    struct Mark { size_t blockIndex, used, count; };
+    Mark mark() const { return Mark{blockIndex_, used_, count_}; }
+    void rewind(const Mark& m) {
+        blockIndex_ = m.blockIndex;
+        used_ = m.used;
+        count_ = m.count;
+    }
+
+    // Forget every object and give the memory back
+    void release() {
+        blocks_.clear();
+        reset();
+    }
+
+    size_t size() const { return count_; }                                  // Live objects
+    size_t capacity() const { return blocks_.size() * objectsPerBlock_; }  // Objects that fit without allocating
+    size_t bytesReserved() const { return capacity() * sizeof(T); }
+
+private:
+    typedef typename aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    void nextBlock() {
+        if (blockIndex_ < blocks_.size()) {
+            blockIndex_++;
+        }
+        if (blockIndex_ == blocks_.size()) {
+            blocks_.emplace_back(new Slot[objectsPerBlock_]);
+        }
+        used_ = 0;
+    }
+
+    size_t objectsPerBlock_;
+    vector<unique_ptr<Slot[]>> blocks_;
+    size_t blockIndex_ = 0; // Block currently being filled
+    size_t used_ = 0;       // Slots used in that block
+    size_t count_ = 0;
+};
+
+#endif // ARENA_H
@@ -0,0 +1,288 @@
+#include "image.h"
+#include "trace.h"
+#include <cstring>
+#include <new>
+#include <algorithm>
+#include <limits>
+#include <cctype>
+
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_MMAP 1
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using namespace std;
+
+Image::Image() : width_(0), height_(0), stride_(0) {}
+
+Image::Image(int width, int height, int rowAlignment) : width_(width), height_(height) {
+    stride_ = width * 3;
+    if (rowAlignment > 1) {
+        stride_ = (stride_ + rowAlignment - 1) / rowAlignment * rowAlignment;
+    }
+
+    size_t bytes = (size_t)stride_ * height;
+    if (bytes == 0) {
+        width_ = height_ = stride_ = 0;
+        return;
+    }
+
+    unsigned char* buffer = static_cast<unsigned char*>(::operator new(bytes, align_val_t(ALIGNMENT)));
+    memset(buffer, 0, bytes);
+    buffer_ = shared_ptr<unsigned char>(buffer, [](unsigned char* p) {
+        ::operator delete(p, align_val_t(ALIGNMENT));
+    });
+}
+
+Image Image::wrap(unsigned char* buffer, int width, int height, int stride, function<void(unsigned char*)> release) {
+    Image image;
+    image.width_ = width;
+    image.height_ = height;
+    image.stride_ = stride;
+    image.buffer_ = shared_ptr<unsigned char>(buffer, release);
+    return image;
+}
+
+void Image::fill(int x, int y, int width, int height, Pixel color) {
+    if (width <= 0 || height <= 0) return;
+
+    unsigned char* first = reinterpret_cast<unsigned char*>(row(y) + x);
+    const size_t bytes = (size_t)width * 3;
+    first[0] = color.r;
+    first[1] = color.g;
+    first[2] = color.b;
+    for (size_t done = 3; done < bytes; done *= 2) {
+        memcpy(first + done, first, min(done, bytes - done));
+    }
+    for (int j = 1; j < height; j++) {
+        memcpy(row(y + j) + x, first, bytes);
+    }
+}
+
+// Load an image with stb_image and take ownership of its buffer directly.
+// Binary PPM/PAM files are mapped instead of decoded.
+Image loadImage(const string& filename) {
+    Image mapped = mapImage(filename);
+    if (!mapped.empty()) {
+        return mapped;
+    }
+
+    TraceScope scope("stbi_load");
+    int width, height, channels;
+    unsigned char* buffer = stbi_load(filename.c_str(), &width, &height, &channels, 3);
+    if (!buffer) {
+        return Image();
+    }
+
+    return Image::wrap(buffer, width, height, width * 3, [](unsigned char* p) {
+        stbi_image_free(p);
+    });
+}
+
+// Same as loadImage for a file already in memory (stb_image formats and PPM)
+Image decodeImage(const unsigned char* data, size_t size) {
+    TraceScope scope("stbi_load");
+    int width, height, channels;
+    unsigned char* buffer = stbi_load_from_memory(data, (int)min(size, (size_t)numeric_limits<int>::max()), &width, &height, &channels, 3);
+    if (!buffer) {
+        return Image();
+    }
+
+    return Image::wrap(buffer, width, height, width * 3, [](unsigned char* p) {
+        stbi_image_free(p);
+    });
+}
+
+// Only the header is read (PPM/PAM are mapped, which reads nothing else)
+bool readImageSize(const string& filename, int& width, int& height) {
+    Image mapped = mapImage(filename);
+    if (!mapped.empty()) {
+        width = mapped.width();
+        height = mapped.height();
+        return true;
+    }
+    int channels;
+    return stbi_info(filename.c_str(), &width, &height, &channels) != 0;
+}
+
+// Header fields are separated by whitespace and may be interleaved with
+// # comments; a single whitespace byte separates the header from the pixels.
+// On success in is positioned at the first pixel byte.
+static bool readPpmHeader(istream& in, int& width, int& height) {
+    string magic;
+    if (!(in >> magic) || magic != "P6") return false;
+
+    int fields[3];
+    for (int i = 0; i < 3; i++) {
+        while ((in >> ws).peek() == '#') {
+            in.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+        if (!(in >> fields[i])) return false;
+    }
+    // A header that ends at EOF has no separator and no pixels after it
+    int separator = in.get();
+    if (separator == EOF || !isspace(separator) || in.fail()) return false;
+
+    width = fields[0];
+    height = fields[1];
+    return width > 0 && height > 0 && fields[2] == 255;
+}
+
+bool PpmReader::open(const string& filename) {
+    file_.open(filename, ios::binary);
+    if (!file_ || !readPpmHeader(file_, width_, height_)) {
+        return false;
+    }
+    dataOffset_ = file_.tellg();
+    if (dataOffset_ < 0) return false;
+
+    // Refuse truncated files up front rather than at the last tile. The
+    // pixel count is unsigned: both sides below 2^31 times 3 cannot wrap.
+    file_.seekg(0, ios::end);
+    streamoff end = file_.tellg();
+    return end >= dataOffset_ && (uint64_t)width_ * height_ * 3 <= (uint64_t)(end - dataOffset_);
+}
+
+Image PpmReader::readRegion(int x, int y, int width, int height) {
+    width = min(width, width_ - x);
+    height = min(height, height_ - y);
+    if (x < 0 || y < 0 || width <= 0 || height <= 0) {
+        return Image();
+    }
+
+    Image region(width, height);
+    for (int j = 0; j < height; j++) {
+        file_.seekg(dataOffset_ + ((streamoff)(y + j) * width_ + x) * 3);
+        file_.read(reinterpret_cast<char*>(region.row(j)), (streamsize)width * 3);
+    }
+    if (!file_) {
+        file_.clear();
+        return Image();
+    }
+    return region;
+}
+
+// PAM header: KEY value lines up to ENDHDR. Only 8-bit RGB is accepted.
+static bool readPamHeader(istream& in, int& width, int& height) {
+    string magic, key;
+    if (!(in >> magic) || magic != "P7") return false;
+
+    int depth = 0, maxValue = 0;
+    width = height = 0;
+    while (in >> key && key != "ENDHDR") {
+        if (key[0] == '#') {
+            in.ignore(numeric_limits<streamsize>::max(), '\n');
+        } else if (key == "WIDTH") {
+            in >> width;
+        } else if (key == "HEIGHT") {
+            in >> height;
+        } else if (key == "DEPTH") {
+            in >> depth;
+        } else if (key == "MAXVAL") {
+            in >> maxValue;
+        } else if (key == "TUPLTYPE") {
+            in.ignore(numeric_limits<streamsize>::max(), '\n');
+        } else {
+            return false;
+        }
+    }
+    // ENDHDR's line must end in a newline, which the pixels follow
+    string rest;
+    if (!getline(in, rest) || in.eof()) return false;
+    return width > 0 && height > 0 && depth == 3 && maxValue == 255;
+}
+
+#ifdef HAVE_MMAP
+// Map a whole file copy-on-write: the pixels are read straight from the page
+// cache, and a stray write would only ever touch a private copy
+static unsigned char* mapFile(const string& filename, size_t& length) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        length = info.st_size;
+        base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    return base == MAP_FAILED ? nullptr : static_cast<unsigned char*>(base);
+}
+
+// View width x height packed pixels at offset of a mapping; the Image unmaps
+// it. Written so that neither side of the bounds check can wrap.
+static Image viewMapping(unsigned char* base, size_t length, size_t offset, int width, int height) {
+    if (offset > length || (size_t)width * height * 3 > length - offset) {
+        munmap(base, length);
+        return Image();
+    }
+    return Image::wrap(base + offset, width, height, width * 3, [base, length](unsigned char*) {
+        munmap(base, length);
+    });
+}
+
+Image mapImage(const string& filename) {
+    size_t length = 0;
+    unsigned char* base = mapFile(filename, length);
+    if (!base) return Image();
+
+    // The header is text at the start of the file; 4 KiB leaves room for comments
+    istringstream header(string(reinterpret_cast<char*>(base), min(length, (size_t)4096)));
+    int width = 0, height = 0;
+    bool valid = length >= 2 && base[0] == 'P' &&
+                 ((base[1] == '6' && readPpmHeader(header, width, height)) ||
+                  (base[1] == '7' && readPamHeader(header, width, height)));
+    streamoff offset = valid ? (streamoff)header.tellg() : -1;
+    if (offset < 0) {
+        munmap(base, length);
+        return Image();
+    }
+    return viewMapping(base, length, (size_t)offset, width, height);
+}
+
+Image mapRawImage(const string& filename, int width, int height) {
+    size_t length = 0;
+    unsigned char* base = mapFile(filename, length);
+    if (!base) return Image();
+    if (width <= 0 || height <= 0) {
+        munmap(base, length);
+        return Image();
+    }
+    return viewMapping(base, length, 0, width, height);
+}
+#else
+// No mmap on this platform: the files are read into an owned buffer instead
+Image mapImage(const string& filename) {
+    ifstream file(filename, ios::binary);
+    int width = 0, height = 0;
+    char magic[2] = {0, 0};
+    file.read(magic, 2);
+    file.seekg(0);
+    if (!file || magic[0] != 'P' ||
+        !((magic[1] == '6' && readPpmHeader(file, width, height)) ||
+          (magic[1] == '7' && readPamHeader(file, width, height)))) {
+        return Image();
+    }
+
+    Image image(width, height);
+    file.read(reinterpret_cast<char*>(image.data()), (streamsize)width * height * 3);
+    return file ? image : Image();
+}
+
+Image mapRawImage(const string& filename, int width, int height) {
+    ifstream file(filename, ios::binary);
+    if (!file || width <= 0 || height <= 0) return Image();
+
+    Image image(width, height);
+    file.read(reinterpret_cast<char*>(image.data()), (streamsize)width * height * 3);
+    return file ? image : Image();
+}
+#endif
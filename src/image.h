@@ -0,0 +1,90 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <string>
+#include <fstream>
+#include <memory>
+#include <functional>
+
+using namespace std;
+
+// Structure to store RGB values of a pixel
+struct Pixel {
+    unsigned char r, g, b;
+};
+
+static_assert(sizeof(Pixel) == 3, "Pixel must map 1:1 onto interleaved RGB bytes");
+
+// RGB image stored in a single contiguous buffer. Rows are stride() bytes
+// apart, and the buffer is reference counted so copying an Image is a cheap
+// view of the same pixels rather than a deep copy.
+class Image {
+public:
+    static const int ALIGNMENT = 64; // Alignment of owned buffers (cache line)
+
+    Image();
+    // Allocate a zeroed, aligned image. rowAlignment > 1 pads every row to a multiple of it
+    Image(int width, int height, int rowAlignment = 1);
+
+    // Wrap an existing interleaved RGB buffer without copying it. release is
+    // called once the last Image referring to the buffer goes away.
+    static Image wrap(unsigned char* buffer, int width, int height, int stride, function<void(unsigned char*)> release);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int stride() const { return stride_; } // Bytes between the starts of two rows
+    bool empty() const { return !buffer_; }
+    bool isPacked() const { return stride_ == width_ * 3; }
+
+    unsigned char* data() { return buffer_.get(); }
+    const unsigned char* data() const { return buffer_.get(); }
+
+    Pixel* row(int y) { return reinterpret_cast<Pixel*>(buffer_.get() + (size_t)y * stride_); }
+    const Pixel* row(int y) const { return reinterpret_cast<const Pixel*>(buffer_.get() + (size_t)y * stride_); }
+
+    Pixel& at(int x, int y) { return row(y)[x]; }
+    const Pixel& at(int x, int y) const { return row(y)[x]; }
+
+    // Paint a rectangle (which must lie inside the image) one color: the
+    // first row is built by doubling memcpy's, the others are copies of it
+    void fill(int x, int y, int width, int height, Pixel color);
+
+private:
+    int width_, height_, stride_;
+    shared_ptr<unsigned char> buffer_;
+};
+
+// Decode an image file (anything stb_image reads) straight into an Image, no extra copy
+Image loadImage(const string& filename);
+// Decode an image file that is already in memory
+Image decodeImage(const unsigned char* data, size_t size);
+
+// Dimensions of an image file without decoding it, false if it cannot be read
+bool readImageSize(const string& filename, int& width, int& height);
+
+// Zero-copy views of uncompressed files: the file is memory-mapped and the
+// Image points into the mapping, which is released with the last reference.
+// mapImage reads binary PPM (P6) and PAM (P7, RGB), both with maxval 255,
+// and returns an empty Image for anything else; mapRawImage takes headerless
+// packed RGB of a known size.
+Image mapImage(const string& filename);
+Image mapRawImage(const string& filename, int width, int height);
+
+// Binary PPM (P6, maxval 255) read a rectangle at a time, for images too
+// large to decode whole. Only the header is read by open().
+class PpmReader {
+public:
+    bool open(const string& filename);
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    // Pixels of [x, x + width) x [y, y + height) clipped to the image, empty on a read error
+    Image readRegion(int x, int y, int width, int height);
+
+private:
+    ifstream file_;
+    streamoff dataOffset_ = 0;
+    int width_ = 0, height_ = 0;
+};
+
+#endif // IMAGE_H
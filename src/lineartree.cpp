@@ -0,0 +1,119 @@
+#include "lineartree.h"
+#include <algorithm>
+
+using namespace std;
+
+static_assert(sizeof(LinearQuadTree::Node) == 8, "linear nodes are meant to be 8 bytes");
+
+// Append a node and its subtree in pre-order, returns the subtree size
+static uint32_t appendNode(vector<LinearQuadTree::Node>& nodes, const QuadTreeNode* node) {
+    size_t self = nodes.size();
+    nodes.push_back(LinearQuadTree::Node{node->avgColor, 0, 1});
+
+    uint8_t children = 0;
+    uint32_t subtreeSize = 1;
+    if (!node->isLeaf) {
+        for (int i = 0; i < 4; i++) {
+            if (node->children[i]) {
+                children |= 1 << i;
+                subtreeSize += appendNode(nodes, node->children[i]);
+            }
+        }
+    }
+
+    nodes[self].children = children;
+    nodes[self].subtreeSize = subtreeSize;
+    return subtreeSize;
+}
+
+LinearQuadTree LinearQuadTree::fromTree(const QuadTreeNode* root, int width, int height) {
+    LinearQuadTree tree;
+    tree.width = width;
+    tree.height = height;
+    if (root) {
+        tree.rootSize = root->size;
+        tree.nodes.reserve(countNodes(root));
+        appendNode(tree.nodes, root);
+    }
+    return tree;
+}
+
+// Position of a block still to be visited. The array is pre-order, so
+// popping blocks in the order their nodes appear keeps the two in step.
+struct LinearBlock {
+    int x, y, size, depth;
+};
+
+// Queue a split node's quadrants so that NW is popped first
+static void pushChildren(vector<LinearBlock>& stack, const LinearQuadTree::Node& node, const LinearBlock& block) {
+    int halfSize = block.size / 2;
+    const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+    for (int i = 3; i >= 0; i--) {
+        if (node.children & (1 << i)) {
+            stack.push_back(LinearBlock{block.x + offsets[i][0], block.y + offsets[i][1], halfSize, block.depth + 1});
+        }
+    }
+}
+
+int LinearQuadTree::depth() const {
+    if (nodes.empty()) return 0;
+
+    int maxDepth = 0;
+    vector<LinearBlock> stack(1, LinearBlock{0, 0, rootSize, 1});
+    for (const Node& node : nodes) {
+        LinearBlock block = stack.back();
+        stack.pop_back();
+        maxDepth = max(maxDepth, block.depth);
+        pushChildren(stack, node, block);
+    }
+    return maxDepth;
+}
+
+Pixel LinearQuadTree::colorAt(int x, int y) const {
+    if (nodes.empty() || x < 0 || y < 0 || x >= width || y >= height) {
+        return Pixel{0, 0, 0};
+    }
+
+    size_t pos = 0;
+    int bx = 0, by = 0, size = rootSize;
+    while (nodes[pos].children) {
+        int halfSize = size / 2;
+        int quadrant = (x >= bx + halfSize ? 1 : 0) + (y >= by + halfSize ? 2 : 0);
+        if (quadrant & 1) bx += halfSize;
+        if (quadrant & 2) by += halfSize;
+        size = halfSize;
+
+        // Skip the subtrees of the quadrants before this one
+        size_t child = pos + 1;
+        for (int i = 0; i < quadrant; i++) {
+            if (nodes[pos].children & (1 << i)) {
+                child += nodes[child].subtreeSize;
+            }
+        }
+        pos = child;
+    }
+    return nodes[pos].color;
+}
+
+// Same image reconstructImage paints from the pointer tree. A node cut off
+// at maxDepth is painted and its subtree stepped over.
+void LinearQuadTree::reconstruct(Image& outputImage, int maxDepth) const {
+    if (nodes.empty()) return;
+
+    vector<LinearBlock> stack(1, LinearBlock{0, 0, rootSize, 1});
+    for (size_t pos = 0; pos < nodes.size();) {
+        const Node& node = nodes[pos];
+        LinearBlock block = stack.back();
+        stack.pop_back();
+        if (node.children && block.depth - 1 < maxDepth) {
+            pushChildren(stack, node, block);
+            pos++;
+            continue;
+        }
+
+        const int xEnd = min(block.x + block.size, outputImage.width());
+        const int yEnd = min(block.y + block.size, outputImage.height());
+        outputImage.fill(block.x, block.y, xEnd - block.x, yEnd - block.y, node.color);
+        pos += node.subtreeSize;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef LINEARTREE_H
+#define LINEARTREE_H
+
+#include <vector>
+#include <cstdint>
+#include "quadtree.h"
+
+using namespace std;
+
+// Pointer-free quadtree: one array of 8-byte nodes in pre-order, which for a
+// quadtree is Morton (Z) order, NW, NE, SW, SE. A node stores no position:
+// coordinates follow from the root size and the path taken, so a
+// QuadTreeNode's 48 bytes shrink six-fold, every traversal is a linear scan,
+// and the array can be written out as is.
+//
+// children has bit i set when quadrant i has a node (quadrants outside the
+// image have none); a node without children is a leaf. subtreeSize counts
+// the node and everything below it, so a whole subtree can be stepped over.
+class LinearQuadTree {
+public:
+    struct Node {
+        Pixel color;
+        uint8_t children;
+        uint32_t subtreeSize;
+    };
+
+    int rootSize = 0;
+    int width = 0, height = 0;
+    vector<Node> nodes;
+
+    static LinearQuadTree fromTree(const QuadTreeNode* root, int width, int height);
+
+    size_t nodeCount() const { return nodes.size(); }
+    size_t bytes() const { return nodes.size() * sizeof(Node); }
+    int depth() const; // Levels, as getTreeDepth counts them
+    // Color of the leaf covering pixel (x, y), one subtree skip per level
+    Pixel colorAt(int x, int y) const;
+    // Nodes at maxDepth (0 = the root) are painted as leaves, as with
+    // reconstructImage
+    void reconstruct(Image& outputImage, int maxDepth = INT_MAX) const;
+};
+
+#endif // LINEARTREE_H
@@ -1,31 +1,149 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <chrono>
 #include <iomanip>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <filesystem>
 #include "quadtree.h"
-
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "threshold.h"
+#include "lineartree.h"
+#include "qtc.h"
+#include "trace.h"
+#include "scheduler.h"
+#include "server.h"
+#include "protocol.h"
 
 using namespace std;
 
-int main(int argc, char** argv) {
-    // Start timing
-    auto start = chrono::high_resolution_clock::now();
-
-    // Default values
+// Everything one compression (or .qtc decode) run needs
+struct CompressionOptions {
     string inputFilePath = "";
+    string outputFilePath = "";
     int errorMethod = 1;
     double threshold = 10.0;
     int minBlockSize = 2;
     double targetCompression = 0.0;
-    string outputFilePath = "";
-    string gifOutputPath = "";
+    bool bottomUp = false;
+    int tileSize = 0; // Tiled build from a PPM input when > 0
+    int rawWidth = 0, rawHeight = 0; // Headerless RGB input of this size when set
+    int maxDepth = -1; // Output image of the tree cut at this depth when >= 0
+    bool linear = false; // Keep the tree as a LinearQuadTree after serializing
+
+    // Server requests keep both ends in memory. The input file's contents
+    // then replace inputFilePath, and the output goes to outputData in the
+    // format of outputFilePath's extension instead of to that file.
+    const vector<unsigned char>* inputData = nullptr;
+    vector<unsigned char>* outputData = nullptr;
+};
+
+// How a batch shares the machine between its images
+struct BatchSettings {
+    string format = "png"; // Output extension for directory batches
+    size_t memoryBudget = (size_t)1024 * 1024 * 1024; // Estimated bytes of the images in flight, 0 = no limit
+    int maxInFlight = 0; // 0 = twice the thread count
+};
 
-    // Get user input
+// What one run produced, for the batch summary
+struct CompressionResult {
+    int width = 0, height = 0;
+    double seconds = 0.0;
+    size_t encodedSize = 0; // Serialized tree (.qtc), 0 when decoding
+    size_t outputSize = 0;  // Bytes of the file written
+    size_t nodes = 0;
+    int depth = 0;
+};
+
+// Lower-case extension of a path, without the dot
+static string fileExtension(const string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == string::npos) return "";
+    string extension = path.substr(dot + 1);
+    transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+// Size of a file in bytes, 0 if it cannot be read
+static size_t fileSize(const string& path) {
+    error_code error;
+    uintmax_t size = filesystem::file_size(path, error);
+    return error ? 0 : (size_t)size;
+}
+
+static void printUsage(const char* program) {
+    cout << "Usage: " << program << " [options]" << endl;
+    cout << "Without -i or --batch the parameters are asked for interactively." << endl;
+    cout << endl;
+    cout << "  -i, --input PATH       image to compress, or a .qtc file to decode" << endl;
+    cout << "  -o, --output PATH      output image (png/jpg/bmp) or .qtc file" << endl;
+    cout << "  -m, --method N         1 Variance, 2 MAD, 3 Max Pixel Difference, 4 Entropy (default 1)" << endl;
+    cout << "  -t, --threshold X      error threshold (default 10)" << endl;
+    cout << "  -b, --min-block N      minimum block size (default 2)" << endl;
+    cout << "      --target X         target compression 0.0-1.0, 0 disables (default 0)" << endl;
+    cout << "      --bottom-up        build from the smallest blocks upwards (same tree)" << endl;
+    cout << "      --raw WxH          the input is headerless packed RGB of W x H pixels" << endl;
+    cout << "      --tile N           read a binary PPM input N x N pixels at a time (N a power" << endl;
+    cout << "                         of two) instead of decoding it whole; not with --target" << endl;
+    cout << "      --linear           convert the tree to the pointer-free linear layout (8 bytes" << endl;
+    cout << "                         per node) after serializing and reconstruct from that" << endl;
+    cout << "      --max-depth N      write the image of the tree cut at depth N (0 = root), a" << endl;
+    cout << "                         coarse preview; also when decoding a .qtc file" << endl;
+    cout << "      --batch PATH       process many images in this process, several at a time." << endl;
+    cout << "                         PATH is a directory (every image in it, written to the" << endl;
+    cout << "                         directory -o as NAME.FORMAT) or a file with one line per image:" << endl;
+    cout << "                         input output [method [threshold [min-block [target]]]]" << endl;
+    cout << "                         missing fields take the values of the flags above" << endl;
+    cout << "      --format EXT       output type of a directory batch (default png)" << endl;
+    cout << "      --batch-memory MB  estimated memory of the images in flight (default 1024, 0 = no limit)" << endl;
+    cout << "      --in-flight N      images in flight at most (default twice the threads)" << endl;
+    cout << "      --serve SOCKET     stay running and answer compression requests on the Unix" << endl;
+    cout << "                         domain socket SOCKET (see src/protocol.h, tools/client.cpp);" << endl;
+    cout << "                         the flags above are the defaults of every request" << endl;
+    cout << "      --threads N        build threads, 0 = all cores (default 1)" << endl;
+    cout << "      --trace FILE       write per-stage timings and counters to FILE as a" << endl;
+    cout << "                         Chrome trace (chrome://tracing, ui.perfetto.dev)" << endl;
+    cout << "  -h, --help             show this help" << endl;
+}
+
+static bool validOptions(const CompressionOptions& options) {
+    if (options.errorMethod < 1 || options.errorMethod > 4) {
+        cerr << "Error: method must be between 1 and 4" << endl;
+        return false;
+    }
+    if (options.minBlockSize < 1) {
+        cerr << "Error: minimum block size must be at least 1" << endl;
+        return false;
+    }
+    if (options.targetCompression < 0.0 || options.targetCompression > 1.0) {
+        cerr << "Error: target compression must be between 0 and 1" << endl;
+        return false;
+    }
+    if (options.tileSize < 0 || (options.tileSize & (options.tileSize - 1)) != 0) {
+        cerr << "Error: tile size must be a power of two" << endl;
+        return false;
+    }
+    if (options.rawWidth > 0 && options.tileSize > 0) {
+        cerr << "Error: --tile needs a PPM input, not --raw" << endl;
+        return false;
+    }
+    if (options.tileSize > 0 && options.targetCompression > 0) {
+        cerr << "Error: --tile cannot be combined with a target compression" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Ask for every parameter on stdin (the original interface)
+static void promptOptions(CompressionOptions& options) {
     cout << "Enter absolute path to input image: ";
-    cin >> inputFilePath;
+    cin >> options.inputFilePath;
 
     cout << "Select error calculation method:" << endl;
     cout << "1. Variance" << endl;
@@ -33,42 +151,165 @@ int main(int argc, char** argv) {
     cout << "3. Max Pixel Difference" << endl;
     cout << "4. Entropy" << endl;
     cout << "Enter method number (1-4): ";
-    cin >> errorMethod;
+    cin >> options.errorMethod;
 
     cout << "Enter threshold value: ";
-    cin >> threshold;
+    cin >> options.threshold;
 
     cout << "Enter minimum block size: ";
-    cin >> minBlockSize;
+    cin >> options.minBlockSize;
 
     cout << "Enter target compression percentage (0.0-1.0, 0 to disable): ";
-    cin >> targetCompression;
+    cin >> options.targetCompression;
 
     cout << "Enter absolute path for output image: ";
-    cin >> outputFilePath;
-    
-    // Load image
-    int imageWidth, imageHeight, imageChannels;
-    unsigned char* imageBuffer = stbi_load(inputFilePath.c_str(), &imageWidth, &imageHeight, &imageChannels, 3);
-    if (!imageBuffer) {
-        cerr << "Error: Could not load image " << inputFilePath << endl;
+    cin >> options.outputFilePath;
+}
+
+// Read a batch manifest. Blank lines and lines starting with # are skipped.
+static bool readManifest(const string& path, const CompressionOptions& defaults, vector<CompressionOptions>& jobs) {
+    ifstream file(path);
+    if (!file) {
+        cerr << "Error: Could not open batch file " << path << endl;
+        return false;
+    }
+
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        istringstream fields(line);
+        CompressionOptions job = defaults;
+        if (!(fields >> job.inputFilePath) || job.inputFilePath[0] == '#') {
+            continue;
+        }
+        if (!(fields >> job.outputFilePath)) {
+            cerr << "Error: " << path << ":" << lineNumber << ": missing output path" << endl;
+            return false;
+        }
+        fields >> job.errorMethod >> job.threshold >> job.minBlockSize >> job.targetCompression;
+        if (fields.fail() && !fields.eof()) {
+            cerr << "Error: " << path << ":" << lineNumber << ": invalid parameters" << endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Whether the input is a serialized tree rather than an image
+static bool isQtcInput(const CompressionOptions& options) {
+    if (options.inputData) {
+        const vector<unsigned char>& data = *options.inputData;
+        return data.size() >= 3 && data[0] == 'Q' && data[1] == 'T' && data[2] == 'C';
+    }
+    return fileExtension(options.inputFilePath) == "qtc";
+}
+
+// Decode a .qtc file back to a raster image
+static int runDecode(const CompressionOptions& options, ostream& out, CompressionResult& result) {
+    vector<unsigned char> encoded;
+    Image decoded;
+    QtcHeader header;
+    int levels = 0;
+    bool truncated = false;
+    {
+        // A breadth-first file cut short still decodes to its complete levels
+        TraceScope scope("decode");
+        const vector<unsigned char>* data = &encoded;
+        if (options.inputData) {
+            data = options.inputData;
+        } else if (!loadQuadTreeFile(options.inputFilePath, encoded)) {
+            data = nullptr;
+        }
+        if (data && readQtcHeader(*data, header)) {
+            levels = decodeQuadTreePreview(*data, decoded, options.maxDepth, &truncated);
+        }
+    }
+    const string inputName = options.inputData ? "the .qtc sent" : options.inputFilePath;
+    if (levels == 0) {
+        cerr << "Error: Could not decode " << inputName << endl;
         return 1;
     }
+    // Only an explicit preview may come from a partial file
+    if (truncated && options.maxDepth < 0) {
+        cerr << "Error: " << inputName << " is truncated, it holds " << levels << " of " << header.levels
+             << " levels; use --max-depth for a preview" << endl;
+        return 1;
+    }
+    TraceScope scope("save image");
+    bool saved = options.outputData ? encodeImage(decoded, fileExtension(options.outputFilePath), *options.outputData)
+                                    : saveQuadTreeImage(options.outputFilePath, decoded);
+    if (!saved) {
+        cerr << "Error: Could not save output image" << endl;
+        return 1;
+    }
+    result.width = decoded.width();
+    result.height = decoded.height();
+    result.outputSize = options.outputData ? options.outputData->size() : fileSize(options.outputFilePath);
+    out << "Decoded " << decoded.width() << "x" << decoded.height() << " image "
+        << (options.outputData ? "kept in memory" : "saved to: " + options.outputFilePath) << endl;
+    if (header.coding == QTC_CODING_LEVELS && levels < header.levels) {
+        out << "Levels decoded: " << levels << " of " << header.levels << (truncated ? " (stream truncated)" : "") << endl;
+    }
+    return 0;
+}
+
+// Compress one image, reporting to out. tree and pool are reused between the runs of a batch
+static int runCompression(const CompressionOptions& options, QuadTree& tree, ThreadPool& pool, ostream& out, CompressionResult& result) {
+    // Start timing
+    auto start = chrono::high_resolution_clock::now();
+    TraceScope compressScope("compress", options.inputFilePath);
+
+    // A .qtc input is decoded back to a raster image
+    if (isQtcInput(options)) {
+        int status = runDecode(options, out, result);
+        result.seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+        return status;
+    }
 
-    // Convert to our internal format
-    vector<vector<Pixel>> imageData(imageHeight, vector<Pixel>(imageWidth));
-    for (int y = 0; y < imageHeight; y++) {
-        for (int x = 0; x < imageWidth; x++) {
-            int idx = (y * imageWidth + x) * 3;
-            imageData[y][x].r = imageBuffer[idx];
-            imageData[y][x].g = imageBuffer[idx + 1];
-            imageData[y][x].b = imageBuffer[idx + 2];
+    const int errorMethod = options.errorMethod;
+    const int minBlockSize = options.minBlockSize;
+    const double targetCompression = options.targetCompression;
+    double threshold = options.threshold;
+
+    // Load image (decoded straight into a flat buffer, no conversion copy).
+    // A tiled build only reads the header here and the pixels tile by tile.
+    Image imageData;
+    PpmReader tiles;
+    {
+        TraceScope scope("load");
+        if (options.tileSize > 0) {
+            if (!tiles.open(options.inputFilePath)) {
+                cerr << "Error: Could not open " << options.inputFilePath << " as a binary PPM (P6, maxval 255)" << endl;
+                return 1;
+            }
+        } else if (options.inputData) {
+            imageData = decodeImage(options.inputData->data(), options.inputData->size());
+            if (imageData.empty()) {
+                cerr << "Error: Could not decode the image sent" << endl;
+                return 1;
+            }
+        } else if (options.rawWidth > 0) {
+            imageData = mapRawImage(options.inputFilePath, options.rawWidth, options.rawHeight);
+            if (imageData.empty()) {
+                cerr << "Error: Could not map " << options.inputFilePath << " as " << options.rawWidth << "x" << options.rawHeight << " raw RGB" << endl;
+                return 1;
+            }
+        } else {
+            // PPM/PAM inputs are memory-mapped, not decoded or copied
+            imageData = loadImage(options.inputFilePath);
+            if (imageData.empty()) {
+                cerr << "Error: Could not load image " << options.inputFilePath << endl;
+                return 1;
+            }
         }
     }
-    stbi_image_free(imageBuffer);
+    int imageWidth = options.tileSize > 0 ? tiles.width() : imageData.width();
+    int imageHeight = options.tileSize > 0 ? tiles.height() : imageData.height();
 
     // Calculate original image size in bytes (assuming 24-bit color)
-    size_t originalSize = imageWidth * imageHeight * 3;
+    size_t originalSize = (size_t)imageWidth * imageHeight * 3;
 
     // Ensure image dimensions are powers of 2 for quadtree
     int maxDim = max(imageWidth, imageHeight);
@@ -77,62 +318,114 @@ int main(int argc, char** argv) {
         size *= 2;
     }
 
+    // Precompute summed-area tables once; every build below reuses them.
+    // The bottom-up build merges block statistics instead and needs none.
+    IntegralImage integral;
+    const bool useIntegral = usesIntegralImage(errorMethod) && (targetCompression > 0 || (!options.bottomUp && options.tileSize == 0));
+    if (useIntegral) {
+        TraceScope scope("integral image");
+        integral = buildIntegralImage(imageData, errorMethod == 1, errorMethod == 3);
+        if (errorMethod == 3) {
+            out << "Min/max pyramid: " << integral.ranges.levels.size() - 1 << " levels, "
+                 << integral.ranges.bytes() << " bytes" << endl;
+        }
+    }
+
     // Adaptive threshold for target compression (Bonus)
     if (targetCompression > 0) {
-        double minThreshold = 0.01;
-        double maxThreshold = 1000.0;
-        double currentCompression = 0.0;
-        int iterations = 0;
-        const int MAX_ITERATIONS = 20;
-        const double STEP_FACTOR = 0.5; // Faktor langkah untuk penyesuaian proporsional
-        
-        while (iterations < MAX_ITERATIONS) {
-            QuadTreeNode* root = buildQuadTree(imageData, 0, 0, size, threshold, minBlockSize, errorMethod);
-            int nodes = countNodes(root);
-            size_t compressedSize = nodes * sizeof(QuadTreeNode);
-            currentCompression = 1.0 - (double)compressedSize / originalSize;
-            
-            cout << "Iteration " << iterations + 1 << ": Threshold = " << threshold 
-                 << ", Nodes = " << nodes << ", Compression = " << (currentCompression * 100) << "%" << endl;
-            
-            if (abs(currentCompression - targetCompression) < 0.01) {
-                cout << "Target compression reached with threshold: " << threshold << endl;
-                delete root;
-                break;
-            }
-            
-            // Hitung error relatif
-            double error =  targetCompression - currentCompression ;
-            
-            // Sesuaikan threshold secara proporsional
-            threshold = threshold * (1.0 + STEP_FACTOR * error);
-            
-            // Pastikan threshold tetap dalam rentang
-            if (threshold < minThreshold) {
-                threshold = minThreshold;
-            } else if (threshold > maxThreshold) {
-                threshold = maxThreshold;
-            }
-            
-            delete root;
-            iterations++;
+        TraceScope scope("threshold search");
+        // Build once to full depth and record every block's error, then pick
+        // the threshold by bisecting over those errors instead of rebuilding
+        ThresholdIndex index = buildThresholdIndex(imageData, size, minBlockSize, errorMethod, useIntegral ? &integral : nullptr);
+        size_t targetNodes = (size_t)max(1.0, (1.0 - targetCompression) * originalSize / sizeof(QuadTreeNode));
+        threshold = findThresholdForNodeCount(index, targetNodes);
+
+        size_t nodes = countNodesAtThreshold(index, threshold);
+        double currentCompression = 1.0 - (double)(nodes * sizeof(QuadTreeNode)) / originalSize;
+        out << "Threshold search over " << index.entries.size() << " blocks: Threshold = " << threshold
+             << ", Nodes = " << nodes << ", Compression = " << (currentCompression * 100) << "%" << endl;
+
+        if (abs(currentCompression - targetCompression) < 0.01) {
+            out << "Target compression reached with threshold: " << threshold << endl;
+        } else {
+            out << "Closest reachable compression uses threshold: " << threshold << endl;
         }
+
+        // The final tree comes straight from the recorded errors
+        buildQuadTreeFromIndex(tree, index, threshold);
+    } else if (options.tileSize > 0) {
+        TraceScope scope("build");
+        if (!tree.buildTiled(tiles, size, options.tileSize, threshold, minBlockSize, errorMethod)) {
+            cerr << "Error: Could not read " << options.inputFilePath << endl;
+            return 1;
+        }
+    } else if (options.bottomUp) {
+        TraceScope scope("build");
+        tree.buildBottomUp(imageData, size, threshold, minBlockSize, errorMethod);
+    } else {
+        // Build the QuadTree
+        TraceScope scope("build");
+        tree.build(imageData, size, threshold, minBlockSize, errorMethod, useIntegral ? &integral : nullptr, &pool);
     }
 
-    // Build the QuadTree
-    QuadTreeNode* root = buildQuadTree(imageData, 0, 0, size, threshold, minBlockSize, errorMethod);
+    const QuadTreeNode* root = tree.root;
 
-    // Calculate tree statistics
-    int totalNodes = countNodes(root);
-    int maxTreeDepth = getTreeDepth(root);
+    // Tree statistics, recorded by the build
+    size_t totalNodes = tree.stats.nodes;
+    int maxTreeDepth = tree.stats.depth;
 
-    // Reconstruct the image
-    vector<vector<Pixel>> outputImage(imageHeight, vector<Pixel>(imageWidth));
-    reconstructImage(root, outputImage);
+    // Serialize the tree; its length is the real compressed size
+    vector<unsigned char> encoded;
+    size_t rawSize;
+    {
+        TraceScope scope("serialize");
+        encoded = encodeQuadTree(root, imageWidth, imageHeight, minBlockSize);
+        rawSize = rawQuadTreeSize(tree.stats, root ? root->size : 0, minBlockSize);
+    }
+    const size_t leafCount = tree.stats.leaves;
 
-    // Save the output image
-    if (!saveQuadTreeImage(outputFilePath, outputImage)) {
-        cerr << "Error: Could not save output image" << endl;
+    // Only the linear tree outlives this point; the pointer nodes go back
+    // to the arenas
+    LinearQuadTree linearTree;
+    if (options.linear) {
+        TraceScope scope("linearize");
+        linearTree = LinearQuadTree::fromTree(root, imageWidth, imageHeight);
+        maxTreeDepth = linearTree.depth();
+        tree.clear();
+        root = nullptr;
+    }
+
+    bool saved = true;
+    if (fileExtension(options.outputFilePath) == "qtc") {
+        // Ship the tree itself instead of a re-rasterized image
+        TraceScope scope("save .qtc");
+        if (options.outputData) {
+            *options.outputData = encoded;
+        } else if (!saveQuadTreeFile(options.outputFilePath, encoded)) {
+            cerr << "Error: Could not save output file" << endl;
+            saved = false;
+        }
+    } else {
+        // Reconstruct the image
+        Image outputImage(imageWidth, imageHeight);
+        {
+            TraceScope scope("reconstruct");
+            const int maxDepth = options.maxDepth < 0 ? INT_MAX : options.maxDepth;
+            if (options.linear) {
+                linearTree.reconstruct(outputImage, maxDepth);
+            } else {
+                reconstructImage(root, outputImage, pool, maxDepth);
+            }
+        }
+
+        // Save the output image
+        TraceScope scope("save image");
+        bool written = options.outputData ? encodeImage(outputImage, fileExtension(options.outputFilePath), *options.outputData)
+                                          : saveQuadTreeImage(options.outputFilePath, outputImage);
+        if (!written) {
+            cerr << "Error: Could not save output image" << endl;
+            saved = false;
+        }
     }
 
     // Calculate compressed size (approximate, based on QuadTree nodes)
@@ -143,18 +436,373 @@ int main(int argc, char** argv) {
     auto end = chrono::high_resolution_clock::now();
     chrono::duration<double> duration = end - start;
 
+    result.width = imageWidth;
+    result.height = imageHeight;
+    result.seconds = duration.count();
+    result.encodedSize = encoded.size();
+    result.outputSize = !saved ? 0 : options.outputData ? options.outputData->size() : fileSize(options.outputFilePath);
+    result.nodes = totalNodes;
+    result.depth = maxTreeDepth;
+
     // Output results
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+    out << fixed << setprecision(2);
+    out << "Execution time: " << duration.count() << " seconds" << endl;
+    out << "Original image size: " << originalSize << " bytes" << endl;
+    out << "Compressed size (approximate): " << compressedSize << " bytes" << endl;
+    out << "Compression percentage: " << compressionPercentage << "%" << endl;
+    out << "Serialized size (.qtc): " << encoded.size() << " bytes ("
+         << (1.0 - (double)encoded.size() / originalSize) * 100.0 << "% compression, "
+         << (double)compressedSize / encoded.size() << "x smaller than the node estimate, "
+         << (double)rawSize / encoded.size() << "x smaller than raw .qtc)" << endl;
+    if (options.linear) {
+        out << "Linear tree size: " << linearTree.bytes() << " bytes (" << linearTree.nodeCount() << " nodes of "
+             << sizeof(LinearQuadTree::Node) << " bytes; the pointer tree took " << totalNodes * sizeof(QuadTreeNode) << ")" << endl;
+    }
+    out << "Tree depth: " << maxTreeDepth << endl;
+    out << "Number of nodes: " << totalNodes << endl;
+    out << "Leaf nodes: " << leafCount << endl;
+    if (options.outputData) {
+        out << "Output kept in memory: " << options.outputData->size() << " bytes (" << fileExtension(options.outputFilePath) << ")" << endl;
+    } else {
+        out << "Output image saved to: " << options.outputFilePath << endl;
+    }
+    out.flags(flags);
+    out.precision(precision);
+
+    return saved ? 0 : 1;
+}
+
+// Jobs for every image in a directory, in name order, written to outputDir
+// as <name>.<format>
+static bool readDirectory(const string& path, const string& outputDir, const string& format, const CompressionOptions& defaults, vector<CompressionOptions>& jobs) {
+    if (outputDir.empty()) {
+        cerr << "Error: a directory batch needs -o OUTPUT_DIRECTORY" << endl;
+        return false;
+    }
+    error_code error;
+    filesystem::create_directories(outputDir, error);
+    if (!filesystem::is_directory(outputDir)) {
+        cerr << "Error: Could not create output directory " << outputDir << endl;
+        return false;
+    }
+
+    vector<filesystem::path> inputs;
+    for (const auto& entry : filesystem::directory_iterator(path, error)) {
+        string extension = fileExtension(entry.path().string());
+        bool image = extension == "jpg" || extension == "jpeg" || extension == "png" || extension == "bmp" ||
+                     extension == "tga" || extension == "ppm" || extension == "pam";
+        if (entry.is_regular_file() && image) {
+            inputs.push_back(entry.path());
+        }
+    }
+    if (error) {
+        cerr << "Error: Could not read directory " << path << endl;
+        return false;
+    }
+    sort(inputs.begin(), inputs.end());
+
+    for (const filesystem::path& input : inputs) {
+        CompressionOptions job = defaults;
+        job.inputFilePath = input.string();
+        job.outputFilePath = (filesystem::path(outputDir) / input.stem()).string() + "." + format;
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Upper bound of what one job holds at its peak: the input pixels, the
+// summed-area tables its method needs, a tree (or threshold index) of every
+// block down to the minimum size, and the reconstructed output. Only the
+// file header is read (the first QTC_HEADER_SIZE bytes of a .qtc); 0 when
+// even that fails, and the job fails fast.
+static size_t estimateJobBytes(const CompressionOptions& options) {
+    int width = 0, height = 0, minBlockSize = options.minBlockSize;
+    bool decode = fileExtension(options.inputFilePath) == "qtc";
+    if (decode) {
+        QtcHeader header;
+        if (!loadQtcHeader(options.inputFilePath, header)) return 0;
+        width = header.width;
+        height = header.height;
+        minBlockSize = header.minBlockSize;
+    } else if (options.rawWidth > 0) {
+        width = options.rawWidth;
+        height = options.rawHeight;
+    } else if (!readImageSize(options.inputFilePath, width, height)) {
+        return 0;
+    }
+
+    const size_t pixels = (size_t)width * height;
+    const size_t blockPixels = (size_t)max(1, minBlockSize) * max(1, minBlockSize);
+    const size_t blocks = (pixels + blockPixels - 1) / blockPixels * 4 / 3 + 1;
+    const bool imageOutput = fileExtension(options.outputFilePath) != "qtc";
+
+    size_t bytes = blocks * sizeof(QuadTreeNode);
+    if (imageOutput) bytes += pixels * sizeof(Pixel);
+    if (decode) return bytes;
+
+    bytes += options.tileSize > 0 ? (size_t)options.tileSize * options.tileSize * sizeof(Pixel) : pixels * sizeof(Pixel);
+    if (usesIntegralImage(options.errorMethod) && (options.targetCompression > 0 || (!options.bottomUp && options.tileSize == 0))) {
+        size_t tablePixels = (size_t)(width + 1) * (height + 1);
+        bytes += tablePixels * sizeof(IntegralImage::Sum);
+        if (options.errorMethod == 1) bytes += tablePixels * sizeof(IntegralImage::SumSq);
+        if (options.errorMethod == 3) bytes += pixels * sizeof(MinMaxPyramid::Range) / 3 + 1; // Levels 1.. shrink 4x each
+    }
+    if (options.targetCompression > 0) {
+        bytes += blocks * (sizeof(ThresholdIndex::Entry) + sizeof(double));
+    }
+    return bytes;
+}
+
+// Every job of a manifest (or every image of a directory) in this process.
+// The images overlap: each is one task on the shared pool going through
+// load, build, reconstruct and save, admitted while its estimated memory
+// fits in the budget. Trees are recycled between jobs so their arenas stay
+// warm. The per-image reports are folded into one summary at the end.
+static int runBatch(const string& batchPath, const BatchSettings& settings, const CompressionOptions& defaults, ThreadPool& pool) {
+    vector<CompressionOptions> jobs;
+    bool listed = filesystem::is_directory(batchPath)
+                      ? readDirectory(batchPath, defaults.outputFilePath, settings.format, defaults, jobs)
+                      : readManifest(batchPath, defaults, jobs);
+    if (!listed) {
+        return 1;
+    }
+
+    TraceScope scope("batch", batchPath);
+    auto start = chrono::high_resolution_clock::now();
+
+    vector<size_t> jobBytes(jobs.size(), 0);
+    vector<bool> valid(jobs.size(), false);
+    for (size_t i = 0; i < jobs.size(); i++) {
+        valid[i] = validOptions(jobs[i]);
+        if (valid[i]) jobBytes[i] = estimateJobBytes(jobs[i]);
+    }
+
+    vector<CompressionResult> results(jobs.size());
+    vector<int> status(jobs.size(), 1);
+    mutex treesMutex;
+    vector<unique_ptr<QuadTree>> freeTrees;
+
+    ScheduleLimits limits = {settings.memoryBudget, settings.maxInFlight};
+    ScheduleReport report = runScheduled(pool, jobBytes, limits, [&](size_t i) {
+        if (!valid[i]) return;
+
+        unique_ptr<QuadTree> tree;
+        {
+            lock_guard<mutex> lock(treesMutex);
+            if (!freeTrees.empty()) {
+                tree = move(freeTrees.back());
+                freeTrees.pop_back();
+            }
+        }
+        if (!tree) tree.reset(new QuadTree());
+
+        ostringstream log; // The full report of a single run, not shown in a batch
+        status[i] = runCompression(jobs[i], *tree, pool, log, results[i]);
+        if (status[i] != 0) {
+            cerr << "Error: " << jobs[i].inputFilePath << " failed" << endl;
+        }
+
+        tree->clear();
+        lock_guard<mutex> lock(treesMutex);
+        freeTrees.push_back(move(tree));
+    });
+    chrono::duration<double> wall = chrono::high_resolution_clock::now() - start;
+
+    // Per-image table in job order, then the totals
+    int failures = 0;
+    double megapixels = 0.0, busySeconds = 0.0;
+    size_t inputBytes = 0, outputBytes = 0;
+    ios::fmtflags flags = cout.flags();
+    streamsize precision = cout.precision();
     cout << fixed << setprecision(2);
-    cout << "Execution time: " << duration.count() << " seconds" << endl;
-    cout << "Original image size: " << originalSize << " bytes" << endl;
-    cout << "Compressed size (approximate): " << compressedSize << " bytes" << endl;
-    cout << "Compression percentage: " << compressionPercentage << "%" << endl;
-    cout << "Tree depth: " << maxTreeDepth << endl;
-    cout << "Number of nodes: " << totalNodes << endl;
-    cout << "Output image saved to: " << outputFilePath << endl;
+    cout << left << setw(6) << "#" << setw(12) << "size" << right << setw(10) << "time (s)" << setw(10) << "nodes"
+         << setw(7) << "depth" << setw(12) << "output" << "  input" << endl;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const CompressionResult& result = results[i];
+        if (status[i] != 0) {
+            failures++;
+            cout << left << setw(6) << (i + 1) << setw(12) << "-" << right << setw(39) << "FAILED" << "  " << jobs[i].inputFilePath << endl;
+            continue;
+        }
+        megapixels += (double)result.width * result.height / 1e6;
+        busySeconds += result.seconds;
+        inputBytes += fileSize(jobs[i].inputFilePath);
+        outputBytes += result.outputSize;
+        cout << left << setw(6) << (i + 1) << setw(12) << (to_string(result.width) + "x" + to_string(result.height)) << right
+             << setw(10) << result.seconds << setw(10) << result.nodes << setw(7) << result.depth << setw(12) << result.outputSize
+             << "  " << jobs[i].inputFilePath << endl;
+    }
 
-    // Clean up
-    delete root;
+    const size_t succeeded = jobs.size() - failures;
+    cout << "Batch finished: " << succeeded << " succeeded, " << failures << " failed" << endl;
+    cout << "Wall time: " << wall.count() << " seconds, " << megapixels << " MP (" << megapixels / wall.count() << " MP/s, "
+         << succeeded / wall.count() << " images/s)" << endl;
+    cout << "Sum of per-image times: " << busySeconds << " seconds (" << busySeconds / wall.count() << " images in flight on average)" << endl;
+    cout << "Input files: " << inputBytes << " bytes, output files: " << outputBytes << " bytes" << endl;
+    cout << "Peak in flight: " << report.peakInFlight << " images, " << report.peakMemory / (1024 * 1024) << " MB estimated" << endl;
+    cout.flags(flags);
+    cout.precision(precision);
+    return failures == 0 ? 0 : 1;
+}
 
-    return 0;
-}
\ No newline at end of file
+// One COMPRESS request of the server. The fields mirror the command line
+// (input or a payload with the file's contents, method, threshold,
+// min-block, target, bottom-up, max-depth, format); the output always
+// comes back as the reply's payload, never as a file the server writes,
+// and the report that a single run prints comes back as report lines.
+static void serveRequest(const Message& request, Message& reply, const CompressionOptions& defaults, QuadTree& tree, ThreadPool& pool) {
+    CompressionOptions job = defaults;
+    job.tileSize = 0;
+    job.rawWidth = job.rawHeight = 0;
+    job.inputFilePath = request.get("input");
+    if (job.inputFilePath.empty()) {
+        job.inputData = &request.payload;
+    }
+    job.errorMethod = atoi(request.get("method", to_string(defaults.errorMethod)).c_str());
+    job.threshold = atof(request.get("threshold", to_string(defaults.threshold)).c_str());
+    job.minBlockSize = atoi(request.get("min-block", to_string(defaults.minBlockSize)).c_str());
+    job.targetCompression = atof(request.get("target", to_string(defaults.targetCompression)).c_str());
+    job.bottomUp = request.get("bottom-up", defaults.bottomUp ? "1" : "0") == "1";
+    job.maxDepth = atoi(request.get("max-depth", to_string(defaults.maxDepth)).c_str());
+    job.outputFilePath = "reply." + request.get("format", "qtc");
+    job.outputData = &reply.payload;
+
+    if (job.inputFilePath.empty() && request.payload.empty()) {
+        reply.command = "ERROR";
+        reply.add("message", "no input path and no image sent");
+        return;
+    }
+    ostringstream log;
+    CompressionResult result;
+    if (!validOptions(job) || runCompression(job, tree, pool, log, result) != 0) {
+        reply.command = "ERROR";
+        reply.add("message", "compression failed, see the server log");
+        reply.payload.clear();
+        return;
+    }
+
+    reply.add("width", to_string(result.width));
+    reply.add("height", to_string(result.height));
+    reply.add("seconds", to_string(result.seconds));
+    reply.add("nodes", to_string(result.nodes));
+    reply.add("depth", to_string(result.depth));
+    reply.add("encoded-size", to_string(result.encodedSize));
+    istringstream report(log.str());
+    string line;
+    while (getline(report, line)) {
+        reply.add("report", line);
+    }
+}
+
+int main(int argc, char** argv) {
+    CompressionOptions options;
+    string batchFilePath = "";
+    BatchSettings batch;
+    int threadCount = 1;
+    string tracePath = "";
+    string socketPath = "";
+    bool interactive = true;
+
+    // Command-line options
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "-h" || arg == "--help") {
+            printUsage(argv[0]);
+            return 0;
+        } else if ((arg == "-i" || arg == "--input") && hasValue) {
+            options.inputFilePath = argv[++i];
+            interactive = false;
+        } else if ((arg == "-o" || arg == "--output") && hasValue) {
+            options.outputFilePath = argv[++i];
+        } else if ((arg == "-m" || arg == "--method") && hasValue) {
+            options.errorMethod = atoi(argv[++i]);
+        } else if ((arg == "-t" || arg == "--threshold") && hasValue) {
+            options.threshold = atof(argv[++i]);
+        } else if ((arg == "-b" || arg == "--min-block") && hasValue) {
+            options.minBlockSize = atoi(argv[++i]);
+        } else if (arg == "--target" && hasValue) {
+            options.targetCompression = atof(argv[++i]);
+        } else if (arg == "--bottom-up") {
+            options.bottomUp = true;
+        } else if (arg == "--linear") {
+            options.linear = true;
+        } else if (arg == "--raw" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.rawWidth, &options.rawHeight) != 2 || options.rawWidth <= 0 || options.rawHeight <= 0) {
+                cerr << "Error: --raw expects WIDTHxHEIGHT" << endl;
+                return 1;
+            }
+        } else if (arg == "--max-depth" && hasValue) {
+            options.maxDepth = atoi(argv[++i]);
+        } else if (arg == "--tile" && hasValue) {
+            options.tileSize = atoi(argv[++i]);
+        } else if (arg == "--batch" && hasValue) {
+            batchFilePath = argv[++i];
+            interactive = false;
+        } else if (arg == "--format" && hasValue) {
+            batch.format = fileExtension(string(".") + argv[++i]);
+        } else if (arg == "--batch-memory" && hasValue) {
+            batch.memoryBudget = (size_t)max(0, atoi(argv[++i])) * 1024 * 1024;
+        } else if (arg == "--in-flight" && hasValue) {
+            batch.maxInFlight = atoi(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            threadCount = atoi(argv[++i]);
+        } else if (arg == "--trace" && hasValue) {
+            tracePath = argv[++i];
+        } else if (arg == "--serve" && hasValue) {
+            socketPath = argv[++i];
+            interactive = false;
+        } else {
+            cerr << "Error: unknown or incomplete option " << arg << endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (threadCount <= 0) {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+    if (!tracePath.empty()) {
+        startTrace();
+    }
+    if (batch.maxInFlight <= 0) {
+        batch.maxInFlight = 2 * threadCount;
+    }
+    ThreadPool pool(threadCount);
+
+    int status;
+    if (!socketPath.empty()) {
+        // The pool and the tree's arenas stay warm from one request to the next
+        QuadTree tree;
+        status = runServer(socketPath, [&](const Message& request, Message& reply) {
+            serveRequest(request, reply, options, tree, pool);
+        });
+    } else if (!batchFilePath.empty()) {
+        status = runBatch(batchFilePath, batch, options, pool);
+    } else {
+        if (interactive) {
+            // Get user input
+            promptOptions(options);
+        } else if (options.outputFilePath.empty()) {
+            cerr << "Error: -o is required with -i" << endl;
+            return 1;
+        }
+
+        if (!validOptions(options)) {
+            return 1;
+        }
+        QuadTree tree;
+        CompressionResult result;
+        status = runCompression(options, tree, pool, cout, result);
+    }
+
+    if (!tracePath.empty()) {
+        if (!writeTrace(tracePath)) {
+            cerr << "Error: Could not write trace " << tracePath << endl;
+            return 1;
+        }
+        cout << "Trace written to: " << tracePath << endl;
+    }
+    return status;
+}
@@ -0,0 +1,183 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+using namespace std;
+
+// Messages between the compression server (quadtree --serve) and its
+// clients over a Unix domain socket. A message is a first line (the command
+// of a request, OK or ERROR in a reply), "key: value" lines, an empty line,
+// and then a payload of exactly `bytes` bytes when that field is present.
+// Text is only ever in the header, so file contents travel unescaped.
+//
+//   COMPRESS                         OK
+//   input: /data/photo.jpg           width: 1920
+//   method: 2                        ...
+//   format: qtc                      report: Tree depth: 11
+//                                    bytes: 48211
+//                                    <48211 bytes of .qtc>
+//
+// A key may repeat (the server sends its report one `report` line each).
+struct Message {
+    string command;
+    vector<pair<string, string>> fields;
+    vector<unsigned char> payload;
+
+    // First value of key, or fallback
+    string get(const string& key, const string& fallback = "") const {
+        for (const auto& field : fields) {
+            if (field.first == key) return field.second;
+        }
+        return fallback;
+    }
+    bool has(const string& key) const {
+        for (const auto& field : fields) {
+            if (field.first == key) return true;
+        }
+        return false;
+    }
+    void add(const string& key, const string& value) {
+        fields.emplace_back(key, value);
+    }
+};
+
+#ifdef HAVE_UNIX_SOCKETS
+static const size_t MAX_HEADER_BYTES = 64 * 1024;
+static const size_t MAX_PAYLOAD_BYTES = (size_t)1 << 31;          // Replies, a decoded image may be large
+static const size_t MAX_REQUEST_PAYLOAD_BYTES = (size_t)256 << 20; // What the server accepts
+
+// A peer that went away is an error return, never a SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+// When a whole message must be through, or NO_DEADLINE. A deadline covers
+// the message, not each call, so a peer trickling a byte at a time cannot
+// stretch it.
+typedef chrono::steady_clock::time_point Deadline;
+static const Deadline NO_DEADLINE = Deadline::max();
+
+inline Deadline deadlineAfter(int timeoutMs) {
+    return timeoutMs < 0 ? NO_DEADLINE : chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+}
+
+// Wait until fd is ready for events; false once the deadline has passed
+inline bool waitReady(int fd, short events, Deadline deadline) {
+    if (deadline == NO_DEADLINE) return true;
+    while (true) {
+        long long remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (remaining <= 0) return false;
+        pollfd waiting = {fd, events, 0};
+        int ready = poll(&waiting, 1, (int)min<long long>(remaining, INT_MAX));
+        if (ready < 0 && errno == EINTR) continue;
+        return ready > 0;
+    }
+}
+
+// With a deadline the calls never block; poll() does the waiting
+inline bool writeAll(int fd, const void* data, size_t size, Deadline deadline = NO_DEADLINE) {
+    const int flags = SEND_FLAGS | (deadline == NO_DEADLINE ? 0 : MSG_DONTWAIT);
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        if (!waitReady(fd, POLLOUT, deadline)) return false;
+        ssize_t written = send(fd, p, size, flags);
+        if (written < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (written <= 0) return false;
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+inline bool readAll(int fd, void* data, size_t size, Deadline deadline = NO_DEADLINE) {
+    const int flags = deadline == NO_DEADLINE ? 0 : MSG_DONTWAIT;
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        if (!waitReady(fd, POLLIN, deadline)) return false;
+        ssize_t got = recv(fd, p, size, flags);
+        if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (got <= 0) return false;
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+
+// The header is read a byte at a time so nothing of the payload is consumed
+// early; it is a few hundred bytes, next to megabytes of pixels. With a
+// timeout (milliseconds) the whole message must arrive within it.
+inline bool readMessage(int fd, Message& message, size_t maxPayload = MAX_PAYLOAD_BYTES, int timeoutMs = -1) {
+    const Deadline deadline = deadlineAfter(timeoutMs);
+    message = Message();
+    string header;
+    while (header.size() < MAX_HEADER_BYTES) {
+        char c;
+        if (!readAll(fd, &c, 1, deadline)) return false;
+        if (c == '\n' && (header.empty() || header.back() == '\n')) break;
+        header += c;
+    }
+    if (header.empty() || header.size() >= MAX_HEADER_BYTES) return false;
+
+    size_t lineStart = 0;
+    while (lineStart < header.size()) {
+        size_t lineEnd = header.find('\n', lineStart);
+        if (lineEnd == string::npos) lineEnd = header.size();
+        string line = header.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+
+        if (message.command.empty()) {
+            message.command = line;
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (colon == string::npos) return false;
+        size_t valueStart = line.find_first_not_of(' ', colon + 1);
+        message.add(line.substr(0, colon), valueStart == string::npos ? "" : line.substr(valueStart));
+    }
+
+    if (message.has("bytes")) {
+        size_t bytes = strtoull(message.get("bytes").c_str(), nullptr, 10);
+        if (bytes > maxPayload) return false;
+        message.payload.resize(bytes);
+        if (!readAll(fd, message.payload.data(), bytes, deadline)) return false;
+    }
+    return true;
+}
+
+// The bytes field is added from the payload, any given one is ignored
+inline bool writeMessage(int fd, const Message& message, int timeoutMs = -1) {
+    const Deadline deadline = deadlineAfter(timeoutMs);
+    string header = message.command + "\n";
+    for (const auto& field : message.fields) {
+        if (field.first == "bytes") continue;
+        header += field.first + ": " + field.second + "\n";
+    }
+    if (!message.payload.empty()) {
+        header += "bytes: " + to_string(message.payload.size()) + "\n";
+    }
+    header += "\n";
+    return writeAll(fd, header.data(), header.size(), deadline) &&
+           writeAll(fd, message.payload.data(), message.payload.size(), deadline);
+}
+
+#endif // HAVE_UNIX_SOCKETS
+
+#endif // PROTOCOL_H
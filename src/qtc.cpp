@@ -0,0 +1,705 @@
+#include "qtc.h"
+#include "rangecoder.h"
+#include "trace.h"
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+static const int QTC_VERSION = 1;
+
+static void putU32(vector<unsigned char>& out, size_t pos, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[pos + i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint32_t getU32(const vector<unsigned char>& in, size_t pos) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)in[pos + i] << (8 * i);
+    }
+    return value;
+}
+
+static bool canSplit(int size, int minBlockSize) {
+    return size > minBlockSize && size / 2 >= minBlockSize;
+}
+
+static bool insideImage(int x, int y, int width, int height) {
+    return x < width && y < height;
+}
+
+// Adaptive models shared by the range-coded encoder and decoder
+struct QtcModels {
+    static const int SPLIT_CONTEXTS = 16;
+    static const int DEPTH_BUCKETS = 4;
+
+    static const int RESIDUAL_BUCKETS = 3;
+
+    BitModel split[SPLIT_CONTEXTS];                                   // By depth
+    BitModel color[3][2][DEPTH_BUCKETS][RESIDUAL_BUCKETS][256];     // By channel, leaf or not, depth, neighbouring residual
+
+    BitModel* splitModel(int depth) { return &split[min(depth, SPLIT_CONTEXTS - 1)]; }
+
+    // R is conditioned on the previous block's R residual, G on this block's R
+    // residual and B on its G residual: flat areas give runs of zero residuals
+    BitModel* colorModel(int channel, bool leaf, int depth, uint32_t neighbourCode) {
+        int bucket = neighbourCode == 0 ? 0 : (neighbourCode <= 6 ? 1 : 2);
+        return color[channel][leaf][min(depth / 3, DEPTH_BUCKETS - 1)][bucket];
+    }
+};
+
+// Signed byte residual <-> small unsigned code (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...)
+static uint32_t zigzag(int residual) {
+    int8_t v = (int8_t)residual;
+    return (uint8_t)((v << 1) ^ (v >> 7));
+}
+
+static int unzigzag(uint32_t code) {
+    return (int)(code >> 1) ^ -(int)(code & 1);
+}
+
+static unsigned char clampChannel(int value) {
+    return (unsigned char)max(0, min(255, value));
+}
+
+// A block's color as residuals from its parent's color, G and B also
+// predicted from the channel before. lastCodeR carries the R residual from
+// one block to the next as context.
+static void encodeColor(RangeEncoder& coder, QtcModels& models, bool leaf, int depth, Pixel color, Pixel parent, uint32_t& lastCodeR) {
+    int dr = color.r - parent.r;
+    int dg = color.g - parent.g;
+    unsigned char predG = clampChannel(parent.g + dr);
+    unsigned char predB = clampChannel(parent.b + dg);
+    uint32_t codeR = zigzag(dr), codeG = zigzag(color.g - predG), codeB = zigzag(color.b - predB);
+    coder.encodeTree(models.colorModel(0, leaf, depth, lastCodeR), 8, codeR);
+    coder.encodeTree(models.colorModel(1, leaf, depth, codeR), 8, codeG);
+    coder.encodeTree(models.colorModel(2, leaf, depth, codeG), 8, codeB);
+    lastCodeR = codeR;
+}
+
+static Pixel decodeColor(RangeDecoder& coder, QtcModels& models, bool leaf, int depth, Pixel parent, uint32_t& lastCodeR) {
+    Pixel color;
+    uint32_t codeR = coder.decodeTree(models.colorModel(0, leaf, depth, lastCodeR), 8);
+    color.r = (unsigned char)(parent.r + unzigzag(codeR));
+    int dr = color.r - parent.r;
+    unsigned char predG = clampChannel(parent.g + dr);
+    uint32_t codeG = coder.decodeTree(models.colorModel(1, leaf, depth, codeR), 8);
+    color.g = (unsigned char)(predG + unzigzag(codeG));
+    int dg = color.g - parent.g;
+    unsigned char predB = clampChannel(parent.b + dg);
+    uint32_t codeB = coder.decodeTree(models.colorModel(2, leaf, depth, codeG), 8);
+    color.b = (unsigned char)(predB + unzigzag(codeB));
+    lastCodeR = codeR;
+    return color;
+}
+
+// Collects the split bits and leaf colors during a pre-order walk (QTC_CODING_RAW)
+struct QtcEncoder {
+    int width, height, minBlockSize;
+    vector<unsigned char> bits;
+    int bitCount = 0;
+    vector<unsigned char> colors;
+
+    void putBit(bool bit) {
+        if (bitCount % 8 == 0) bits.push_back(0);
+        if (bit) bits.back() |= 0x80 >> (bitCount % 8);
+        bitCount++;
+    }
+
+    void encode(const QuadTreeNode* node) {
+        if (canSplit(node->size, minBlockSize)) {
+            putBit(!node->isLeaf);
+        }
+
+        if (node->isLeaf) {
+            if (insideImage(node->x, node->y, width, height)) {
+                colors.push_back(node->avgColor.r);
+                colors.push_back(node->avgColor.g);
+                colors.push_back(node->avgColor.b);
+            }
+            return;
+        }
+
+        for (int i = 0; i < 4; i++) {
+            if (node->children[i]) {
+                encode(node->children[i]);
+            } else if (canSplit(node->size / 2, minBlockSize)) {
+                putBit(false); // Quadrant outside the image, stored as an unsplit block
+            }
+        }
+    }
+};
+
+// Range codes split flags and predicted colors in one stream (QTC_CODING_RANGE)
+struct QtcRangeEncoder {
+    int width, height, minBlockSize;
+    QtcModels models;
+    RangeEncoder coder;
+    uint32_t lastCodeR = 0;
+
+    QtcRangeEncoder(vector<unsigned char>& out) : coder(out) {}
+
+    void encode(const QuadTreeNode* node, int depth, Pixel parent) {
+        if (canSplit(node->size, minBlockSize)) {
+            coder.encodeBit(*models.splitModel(depth), !node->isLeaf);
+        }
+
+        Pixel color = Pixel{0, 0, 0};
+        if (insideImage(node->x, node->y, width, height)) {
+            color = node->avgColor;
+            encodeColor(coder, models, node->isLeaf, depth, color, parent, lastCodeR);
+        }
+
+        if (!node->isLeaf) {
+            for (int i = 0; i < 4; i++) {
+                if (node->children[i]) {
+                    encode(node->children[i], depth + 1, color);
+                } else if (canSplit(node->size / 2, minBlockSize)) {
+                    coder.encodeBit(*models.splitModel(depth + 1), false); // Quadrant outside the image
+                }
+            }
+        }
+    }
+};
+
+static const Pixel QTC_ROOT_PREDICTION = {128, 128, 128};
+
+// Range codes the tree one depth at a time (QTC_CODING_LEVELS). The models
+// carry over from level to level; the coder is flushed at the end of each.
+struct QtcLevelEncoder {
+    int width, height, minBlockSize;
+    QtcModels models;
+    uint32_t lastCodeR = 0;
+
+    struct Block {
+        const QuadTreeNode* node;
+        Pixel parent;
+    };
+
+    // Appends the level table and one section per level to out, returns
+    // the number of levels
+    int encode(const QuadTreeNode* root, vector<unsigned char>& out) {
+        vector<vector<unsigned char>> sections;
+        vector<Block> level, next;
+        if (root) level.push_back(Block{root, QTC_ROOT_PREDICTION});
+
+        for (int depth = 0; !level.empty(); depth++) {
+            vector<unsigned char> section;
+            RangeEncoder coder(section);
+            next.clear();
+            for (const Block& block : level) {
+                const QuadTreeNode* node = block.node;
+                if (canSplit(node->size, minBlockSize)) {
+                    coder.encodeBit(*models.splitModel(depth), !node->isLeaf);
+                }
+                encodeColor(coder, models, node->isLeaf, depth, node->avgColor, block.parent, lastCodeR);
+                if (!node->isLeaf) {
+                    for (int i = 0; i < 4; i++) {
+                        if (node->children[i]) next.push_back(Block{node->children[i], node->avgColor});
+                    }
+                }
+            }
+            coder.flush();
+            sections.push_back(move(section));
+            level.swap(next);
+        }
+
+        size_t table = out.size();
+        out.resize(table + 4 * sections.size());
+        for (size_t i = 0; i < sections.size(); i++) {
+            putU32(out, table + 4 * i, sections[i].size());
+        }
+        for (const auto& section : sections) {
+            out.insert(out.end(), section.begin(), section.end());
+        }
+        return sections.size();
+    }
+};
+
+// Serialize a tree into the .qtc layout described in qtc.h
+vector<unsigned char> encodeQuadTree(const QuadTreeNode* root, int width, int height, int minBlockSize, int coding) {
+    vector<unsigned char> out(QTC_HEADER_SIZE, 0);
+    out[0] = 'Q';
+    out[1] = 'T';
+    out[2] = 'C';
+    out[3] = QTC_VERSION;
+    out[4] = coding;
+    putU32(out, 8, width);
+    putU32(out, 12, height);
+    putU32(out, 16, root ? root->size : 0);
+    putU32(out, 20, minBlockSize);
+
+    if (coding == QTC_CODING_LEVELS) {
+        unique_ptr<QtcLevelEncoder> encoder(new QtcLevelEncoder());
+        encoder->width = width;
+        encoder->height = height;
+        encoder->minBlockSize = minBlockSize;
+        int levels = encoder->encode(root, out);
+        putU32(out, 24, 4 * levels);
+        return out;
+    }
+
+    if (coding == QTC_CODING_RANGE) {
+        unique_ptr<QtcRangeEncoder> encoder(new QtcRangeEncoder(out)); // Models are too big for the stack
+        encoder->width = width;
+        encoder->height = height;
+        encoder->minBlockSize = minBlockSize;
+        if (root) {
+            encoder->encode(root, 0, QTC_ROOT_PREDICTION);
+        }
+        encoder->coder.flush();
+        putU32(out, 24, out.size() - QTC_HEADER_SIZE);
+        return out;
+    }
+
+    QtcEncoder encoder;
+    encoder.width = width;
+    encoder.height = height;
+    encoder.minBlockSize = minBlockSize;
+    if (root) {
+        encoder.encode(root);
+    }
+
+    putU32(out, 24, encoder.bits.size());
+    out.insert(out.end(), encoder.bits.begin(), encoder.bits.end());
+    out.insert(out.end(), encoder.colors.begin(), encoder.colors.end());
+    return out;
+}
+
+// Every node of a tree lies inside the image, so the only blocks RAW codes
+// without a node are the missing quadrants of internal nodes
+size_t rawQuadTreeSize(const TreeStats& stats, int rootSize, int minBlockSize) {
+    size_t splitBits = 0;
+    for (int depth = 0; depth < stats.depth; depth++) {
+        int size = rootSize >> depth;
+        if (canSplit(size, minBlockSize)) {
+            splitBits += stats.nodesPerDepth[depth];
+        }
+        size_t internal = stats.nodesPerDepth[depth] - stats.leavesPerDepth[depth];
+        size_t children = depth + 1 < TreeStats::MAX_DEPTH ? stats.nodesPerDepth[depth + 1] : 0;
+        if (internal > 0 && canSplit(size / 2, minBlockSize)) {
+            splitBits += 4 * internal - children;
+        }
+    }
+    return QTC_HEADER_SIZE + (splitBits + 7) / 8 + 3 * stats.leaves;
+}
+
+bool saveQuadTreeFile(const string& filename, const QuadTreeNode* root, int width, int height, int minBlockSize, int coding) {
+    return saveQuadTreeFile(filename, encodeQuadTree(root, width, height, minBlockSize, coding));
+}
+
+bool saveQuadTreeFile(const string& filename, const vector<unsigned char>& data) {
+    ofstream file(filename, ios::binary);
+    if (!file) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    traceCount(TRACE_BYTES_WRITTEN, data.size());
+    return file.good();
+}
+
+bool loadQuadTreeFile(const string& filename, vector<unsigned char>& data) {
+    ifstream file(filename, ios::binary);
+    if (!file) {
+        return false;
+    }
+    data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return true;
+}
+
+bool loadQtcHeader(const string& filename, QtcHeader& header) {
+    ifstream file(filename, ios::binary);
+    if (!file) {
+        return false;
+    }
+    vector<unsigned char> data(QTC_HEADER_SIZE);
+    file.read(reinterpret_cast<char*>(data.data()), QTC_HEADER_SIZE);
+    data.resize(file.gcount());
+    return readQtcHeader(data, header);
+}
+
+bool readQtcHeader(const vector<unsigned char>& data, QtcHeader& header) {
+    if (data.size() < QTC_HEADER_SIZE || data[0] != 'Q' || data[1] != 'T' || data[2] != 'C') {
+        cerr << "Not a .qtc stream" << endl;
+        return false;
+    }
+    if (data[3] != QTC_VERSION) {
+        cerr << "Unsupported .qtc version: " << (int)data[3] << endl;
+        return false;
+    }
+
+    header.coding = data[4];
+    header.levels = 0;
+    if (header.coding != QTC_CODING_RAW && header.coding != QTC_CODING_RANGE && header.coding != QTC_CODING_LEVELS) {
+        cerr << "Unsupported .qtc coding: " << header.coding << endl;
+        return false;
+    }
+
+    // Checked as read, before any of them sizes an allocation
+    uint32_t width = getU32(data, 8), height = getU32(data, 12);
+    uint32_t rootSize = getU32(data, 16), minBlockSize = getU32(data, 20);
+    if (width < 1 || height < 1 || width > QTC_MAX_DIMENSION || height > QTC_MAX_DIMENSION) {
+        cerr << "Invalid .qtc image size: " << width << "x" << height << endl;
+        return false;
+    }
+    uint32_t expectedRoot = 1;
+    while (expectedRoot < max(width, height)) {
+        expectedRoot *= 2;
+    }
+    if (rootSize != expectedRoot || minBlockSize < 1) {
+        cerr << "Invalid .qtc header: root size " << rootSize << ", minimum block " << minBlockSize << endl;
+        return false;
+    }
+    header.width = width;
+    header.height = height;
+    header.rootSize = rootSize;
+    header.minBlockSize = minBlockSize;
+    if (header.coding == QTC_CODING_LEVELS) {
+        // One level per block size from the root down to 1 at most
+        uint32_t table = getU32(data, 24);
+        int maxLevels = 1;
+        while ((rootSize >> (maxLevels - 1)) > 1) {
+            maxLevels++;
+        }
+        if (table % 4 != 0 || table / 4 < 1 || table / 4 > (uint32_t)maxLevels) {
+            cerr << "Corrupt .qtc stream: " << table / 4 << " levels for a root of " << rootSize << endl;
+            return false;
+        }
+        header.levels = table / 4;
+    }
+    return true;
+}
+
+// Walks a .qtc payload, optionally building nodes and/or painting leaves
+// into an image. Every read is bounds checked.
+struct QtcDecoder {
+    const vector<unsigned char>& data;
+    QtcHeader header;
+    NodeArena* arena;
+    Image* image;
+    bool ok = true;
+
+    // QTC_CODING_RAW state, positions relative to the start of data
+    size_t bitPos = 0, bitEnd = 0;   // In bits
+    size_t colorPos = 0;
+
+    // QTC_CODING_LEVELS: levels to decode at most, whether running out of
+    // data ends the decode early instead of failing it, and levels done
+    int maxLevels = INT_MAX;
+    bool partial = false;
+    int levelsDecoded = 0;
+    bool truncated = false; // Data ran out before maxLevels levels
+    const char* failure = "Truncated .qtc stream";
+
+    // QTC_CODING_RANGE state
+    RangeDecoder* coder = nullptr;
+    QtcModels* models = nullptr;
+    uint32_t lastCodeR = 0;
+
+    QtcDecoder(const vector<unsigned char>& data) : data(data), arena(nullptr), image(nullptr) {}
+
+    bool getBit() {
+        if (bitPos >= bitEnd) {
+            ok = false;
+            return false;
+        }
+        bool bit = data[bitPos / 8] & (0x80 >> (bitPos % 8));
+        bitPos++;
+        return bit;
+    }
+
+    Pixel getColor() {
+        Pixel color = {0, 0, 0};
+        if (colorPos + 3 > data.size()) {
+            ok = false;
+            return color;
+        }
+        color.r = data[colorPos];
+        color.g = data[colorPos + 1];
+        color.b = data[colorPos + 2];
+        colorPos += 3;
+        return color;
+    }
+
+    // Pixels of the block inside the image, used to weight internal colors
+    long long area(int x, int y, int size) const {
+        long long w = max(0, min(x + size, header.width) - x);
+        long long h = max(0, min(y + size, header.height) - y);
+        return w * h;
+    }
+
+    // Blocks outside the image are read but get no node, as in a built tree
+    QuadTreeNode* createNode(int x, int y, int size) {
+        return arena && insideImage(x, y, header.width, header.height) ? arena->create(x, y, size) : nullptr;
+    }
+
+    QuadTreeNode* decodeRaw(int x, int y, int size, Pixel& color) {
+        QuadTreeNode* node = createNode(x, y, size);
+        bool split = canSplit(size, header.minBlockSize) && getBit();
+        if (!ok) return node;
+
+        if (!split) {
+            color = insideImage(x, y, header.width, header.height) ? getColor() : Pixel{0, 0, 0};
+            if (node) node->avgColor = color;
+            if (image && ok) fill(x, y, size, color);
+            return node;
+        }
+
+        int halfSize = size / 2;
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        long long sums[3] = {0, 0, 0}, total = 0;
+        for (int i = 0; i < 4 && ok; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            Pixel childColor;
+            QuadTreeNode* child = decodeRaw(cx, cy, halfSize, childColor);
+            if (node) node->children[i] = child;
+
+            long long a = area(cx, cy, halfSize);
+            sums[0] += childColor.r * a;
+            sums[1] += childColor.g * a;
+            sums[2] += childColor.b * a;
+            total += a;
+        }
+
+        color = Pixel{0, 0, 0};
+        if (total > 0) {
+            color.r = sums[0] / total;
+            color.g = sums[1] / total;
+            color.b = sums[2] / total;
+        }
+        if (node) {
+            node->isLeaf = false;
+            node->avgColor = color;
+        }
+        return node;
+    }
+
+    QuadTreeNode* decodeRange(int x, int y, int size, int depth, Pixel parent) {
+        QuadTreeNode* node = createNode(x, y, size);
+        bool split = canSplit(size, header.minBlockSize) && coder->decodeBit(*models->splitModel(depth));
+
+        Pixel color = Pixel{0, 0, 0};
+        if (insideImage(x, y, header.width, header.height)) {
+            color = decodeColor(*coder, *models, !split, depth, parent, lastCodeR);
+        }
+        if (coder->overrun()) {
+            ok = false;
+            return node;
+        }
+
+        if (node) node->avgColor = color;
+        if (!split) {
+            if (image) fill(x, y, size, color);
+            return node;
+        }
+
+        if (node) node->isLeaf = false;
+        int halfSize = size / 2;
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        for (int i = 0; i < 4 && ok; i++) {
+            QuadTreeNode* child = decodeRange(x + offsets[i][0], y + offsets[i][1], halfSize, depth + 1, color);
+            if (node) node->children[i] = child;
+        }
+        return node;
+    }
+
+    struct Block {
+        int x, y, size;
+        Pixel parent;
+        QuadTreeNode* node;
+    };
+
+    // Levels are decoded while their section is complete in data. Blocks of
+    // the first level left out keep their parent's color, so the nodes above
+    // them act as leaves: the tree and image are those of the prefix.
+    void decodeLevels(size_t tableStart) {
+        size_t pos = tableStart + 4 * (size_t)header.levels;
+        uint64_t total = pos;
+        for (int depth = 0; depth < header.levels; depth++) {
+            total += getU32(data, tableStart + 4 * depth);
+        }
+        if (total < data.size()) {
+            failure = "Corrupt .qtc stream: data past the last level";
+            ok = false;
+            return;
+        }
+
+        unique_ptr<QtcModels> levelModels(new QtcModels());
+        vector<Block> level, next;
+        if (header.levels > 0) {
+            level.push_back(Block{0, 0, header.rootSize, QTC_ROOT_PREDICTION, createNode(0, 0, header.rootSize)});
+            rootNode = level[0].node;
+        }
+
+        for (int depth = 0; depth < header.levels && !level.empty(); depth++) {
+            size_t length = getU32(data, tableStart + 4 * depth);
+            if (depth >= maxLevels) break;
+            if (pos + length > data.size()) {
+                truncated = true;
+                break;
+            }
+            RangeDecoder levelCoder(data.data() + pos, length);
+            pos += length;
+
+            next.clear();
+            for (const Block& block : level) {
+                bool split = canSplit(block.size, header.minBlockSize) && levelCoder.decodeBit(*levelModels->splitModel(depth));
+                Pixel color = decodeColor(levelCoder, *levelModels, !split, depth, block.parent, lastCodeR);
+                if (block.node) block.node->avgColor = color;
+                if (!split) {
+                    if (image) fill(block.x, block.y, block.size, color);
+                    continue;
+                }
+
+                if (block.node) block.node->isLeaf = false;
+                int halfSize = block.size / 2;
+                const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+                for (int i = 0; i < 4; i++) {
+                    int cx = block.x + offsets[i][0], cy = block.y + offsets[i][1];
+                    if (!insideImage(cx, cy, header.width, header.height)) continue;
+                    QuadTreeNode* child = createNode(cx, cy, halfSize);
+                    if (block.node) block.node->children[i] = child;
+                    next.push_back(Block{cx, cy, halfSize, color, child});
+                }
+            }
+            if (levelCoder.overrun()) {
+                failure = "Corrupt .qtc stream: a level is longer than its section";
+                ok = false;
+                return;
+            }
+            levelsDecoded++;
+            level.swap(next);
+        }
+
+        // The split flags must account for exactly the levels in the table
+        if (level.empty() != (levelsDecoded == header.levels)) {
+            failure = "Corrupt .qtc stream: the levels do not match the level table";
+            ok = false;
+            return;
+        }
+        if (level.empty()) return;
+        if (truncated && !partial) {
+            ok = false;
+            return;
+        }
+        for (const Block& block : level) {
+            if (block.node) block.node->avgColor = block.parent;
+            if (image) fill(block.x, block.y, block.size, block.parent);
+        }
+    }
+
+    void fill(int x, int y, int size, Pixel color) {
+        image->fill(x, y, min(x + size, image->width()) - x, min(y + size, image->height()) - y, color);
+    }
+
+    bool run() {
+        if (!readQtcHeader(data, header)) return false;
+
+        size_t payload = getU32(data, 24);
+        if (QTC_HEADER_SIZE + payload > data.size()) {
+            cerr << "Truncated .qtc stream" << endl;
+            return false;
+        }
+
+        if (header.coding == QTC_CODING_LEVELS) {
+            decodeLevels(QTC_HEADER_SIZE);
+        } else if (header.coding == QTC_CODING_RANGE) {
+            RangeDecoder rangeDecoder(data.data() + QTC_HEADER_SIZE, payload);
+            unique_ptr<QtcModels> rangeModels(new QtcModels());
+            coder = &rangeDecoder;
+            models = rangeModels.get();
+            rootNode = decodeRange(0, 0, header.rootSize, 0, QTC_ROOT_PREDICTION);
+            coder = nullptr;
+            models = nullptr;
+        } else {
+            bitPos = QTC_HEADER_SIZE * 8;
+            bitEnd = (QTC_HEADER_SIZE + payload) * 8;
+            colorPos = QTC_HEADER_SIZE + payload;
+
+            Pixel rootColor;
+            rootNode = decodeRaw(0, 0, header.rootSize, rootColor);
+        }
+
+        if (!ok) {
+            cerr << failure << endl;
+        }
+        return ok;
+    }
+
+    QuadTreeNode* rootNode = nullptr;
+};
+
+bool decodeQuadTree(const vector<unsigned char>& data, QuadTree& tree, QtcHeader& header) {
+    tree.clear();
+    if (tree.arenas.empty()) {
+        tree.arenas.emplace_back();
+    }
+
+    QtcDecoder decoder(data);
+    decoder.arena = &tree.arenas[0];
+    if (!decoder.run()) {
+        tree.clear();
+        return false;
+    }
+    tree.root = decoder.rootNode;
+    tree.stats = computeTreeStats(tree.root);
+    traceCount(TRACE_NODES_CREATED, tree.stats.nodes);
+    header = decoder.header;
+    return true;
+}
+
+// The raster of a header, refused when it is larger than QTC_MAX_IMAGE_BYTES.
+// width * height * 3 cannot overflow: both sides are at most 2^24.
+static bool allocateImage(const QtcHeader& header, Image& image) {
+    uint64_t bytes = (uint64_t)header.width * header.height * 3;
+    if (bytes > QTC_MAX_IMAGE_BYTES) {
+        cerr << "Image too large to decode: " << header.width << "x" << header.height << endl;
+        return false;
+    }
+    image = Image(header.width, header.height);
+    return true;
+}
+
+bool decodeQuadTreeImage(const vector<unsigned char>& data, Image& image) {
+    QtcHeader header;
+    if (!readQtcHeader(data, header) || !allocateImage(header, image)) return false;
+
+    QtcDecoder decoder(data);
+    decoder.image = &image;
+    return decoder.run();
+}
+
+int decodeQuadTreePreview(const vector<unsigned char>& data, Image& image, int maxDepth, bool* truncated) {
+    if (truncated) *truncated = false;
+    QtcHeader header;
+    if (!readQtcHeader(data, header)) return 0;
+    const int maxLevels = maxDepth < 0 ? INT_MAX : maxDepth + 1;
+
+    if (header.coding != QTC_CODING_LEVELS) {
+        QuadTree tree;
+        if (!decodeQuadTree(data, tree, header) || !allocateImage(header, image)) return 0;
+        reconstructImage(tree.root, image, maxLevels - 1);
+        return min(tree.stats.depth, maxLevels);
+    }
+
+    if (QTC_HEADER_SIZE + 4 * (size_t)header.levels > data.size()) {
+        cerr << "Truncated .qtc stream" << endl;
+        return 0;
+    }
+    if (!allocateImage(header, image)) return 0;
+    QtcDecoder decoder(data);
+    decoder.image = &image;
+    decoder.maxLevels = maxLevels;
+    decoder.partial = true;
+    if (!decoder.run()) return 0;
+    if (decoder.levelsDecoded == 0) {
+        cerr << "Truncated .qtc stream" << endl;
+        return 0;
+    }
+    if (truncated) *truncated = decoder.truncated;
+    return decoder.levelsDecoded;
+}
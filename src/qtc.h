@@ -0,0 +1,93 @@
+#ifndef QTC_H
+#define QTC_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "quadtree.h"
+
+using namespace std;
+
+// Serialized quadtree (.qtc)
+//
+// Layout, all integers little endian:
+//   0  "QTC"           magic
+//   3  u8  version     1
+//   4  u8  coding      QTC_CODING_RAW, QTC_CODING_RANGE or QTC_CODING_LEVELS
+//   5  3 bytes         reserved, zero
+//   8  u32 width       image size in pixels
+//  12  u32 height
+//  16  u32 rootSize    power-of-two side of the root block
+//  20  u32 minBlock    minimum block size used by the encoder
+//  24  u32 payload     length of the first payload section
+//  28  payload
+//
+// Blocks are visited in pre-order (NW, NE, SW, SE). Blocks too small to
+// split (see minBlock) carry no split flag and blocks lying entirely
+// outside the image carry no color. Trees have no nodes for those blocks;
+// they are written as unsplit and decoded back to null children.
+//
+// QTC_CODING_RAW: the payload is the split flags, one bit per block,
+// 1 = split, MSB first; the RGB triplets of the leaves follow it. Decoded
+// internal nodes get the area-weighted average of their children.
+//
+// QTC_CODING_RANGE: the payload is a single adaptive range-coded stream
+// (rangecoder.h). Per block it holds the split flag, modelled per depth,
+// then the block's color as a delta from its parent's color (the root is
+// predicted as mid-gray). G and B are also predicted from the deltas of
+// the channel before, so only the residual is coded. Every node's color
+// is stored, internal nodes included.
+//
+// QTC_CODING_LEVELS: the same split flags and colors with the same models,
+// but blocks are visited breadth first, one depth at a time, and only blocks
+// inside the image appear at all. The payload is a table of u32 section
+// lengths, one per level (so payload / 4 is the level count); the sections
+// follow it, each level range coded and flushed on its own. The models
+// carry over from one level to the next. Any prefix of the file that holds
+// levels 0..d decodes to the tree cut at depth d, a coarse but complete
+// image, which is what a viewer shows while the rest is still arriving.
+struct QtcHeader {
+    int width, height;
+    int rootSize;
+    int minBlockSize;
+    int coding;
+    int levels;  // QTC_CODING_LEVELS only, 0 otherwise
+};
+
+static const int QTC_HEADER_SIZE = 28;
+static const int QTC_CODING_RAW = 0;
+static const int QTC_CODING_RANGE = 1;
+static const int QTC_CODING_LEVELS = 2;
+
+// Limits of what a reader accepts, so a corrupt header cannot request an
+// absurd allocation: sides as stb_image allows, and the decoded raster
+static const uint32_t QTC_MAX_DIMENSION = 1 << 24;
+static const uint64_t QTC_MAX_IMAGE_BYTES = (uint64_t)1 << 32;
+
+vector<unsigned char> encodeQuadTree(const QuadTreeNode* root, int width, int height, int minBlockSize, int coding = QTC_CODING_LEVELS);
+bool saveQuadTreeFile(const string& filename, const QuadTreeNode* root, int width, int height, int minBlockSize, int coding = QTC_CODING_LEVELS);
+// Write bytes encodeQuadTree already produced
+bool saveQuadTreeFile(const string& filename, const vector<unsigned char>& data);
+// Length of the QTC_CODING_RAW encoding of a tree with these statistics,
+// without encoding it (RAW is fixed width)
+size_t rawQuadTreeSize(const TreeStats& stats, int rootSize, int minBlockSize);
+
+// Rejects sizes outside 1..QTC_MAX_DIMENSION, a rootSize other than the
+// power of two covering the image, and a minBlock below 1
+bool readQtcHeader(const vector<unsigned char>& data, QtcHeader& header);
+// Rebuild the tree into tree's arenas
+bool decodeQuadTree(const vector<unsigned char>& data, QuadTree& tree, QtcHeader& header);
+// Rasterize the leaves straight into an image, no tree is built
+bool decodeQuadTreeImage(const vector<unsigned char>& data, Image& image);
+// Image of the tree cut at maxDepth (everything when negative). A
+// QTC_CODING_LEVELS stream may be cut short: the levels complete in data
+// are used, and truncated is set when that is fewer than asked for. A level
+// table that disagrees with the header or the levels is corrupt, not short.
+// The other codings need the whole stream. Returns the number of levels
+// painted, 0 on error.
+int decodeQuadTreePreview(const vector<unsigned char>& data, Image& image, int maxDepth = -1, bool* truncated = nullptr);
+bool loadQuadTreeFile(const string& filename, vector<unsigned char>& data);
+// Read and check only the first QTC_HEADER_SIZE bytes of a file
+bool loadQtcHeader(const string& filename, QtcHeader& header);
+
+#endif // QTC_H
@@ -1,8 +1,12 @@
 #include "quadtree.h"
+#include "simd.h"
+#include "trace.h"
 #include <cmath>
 #include <algorithm>
-#include <map>
 #include <iostream>
+#include <cstring>
+#include <fstream>
+#include <array>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -16,63 +20,124 @@ QuadTreeNode::QuadTreeNode(int x, int y, int size) : x(x), y(y), size(size), isL
     }
 }
 
-// QuadTreeNode destructor
-QuadTreeNode::~QuadTreeNode() {
-    for (int i = 0; i < 4; i++) {
-        if (children[i]) {
-            delete children[i];
-        }
-    }
+// Pixels of the block [x, xEnd) x [y, yEnd), 0 when it lies outside the image
+static long long blockPixels(int x, int y, int xEnd, int yEnd) {
+    return (xEnd > x && yEnd > y) ? (long long)(xEnd - x) * (yEnd - y) : 0;
 }
 
-// Calculate average color of a block
-Pixel calculateAvgColor(const vector<vector<Pixel>>& data, int x, int y, int size) {
-    long sumR = 0, sumG = 0, sumB = 0;
-    int count = 0;
+// Average color of a block from its channel sums, 0 for an empty block
+static Pixel averageFromSums(const uint64_t sums[3], long long count) {
+    Pixel avg = {0, 0, 0};
+    if (count > 0) {
+        avg.r = static_cast<unsigned char>(sums[0] / count);
+        avg.g = static_cast<unsigned char>(sums[1] / count);
+        avg.b = static_cast<unsigned char>(sums[2] / count);
+    }
+    return avg;
+}
 
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[0].size(); i++) {
-            sumR += data[j][i].r;
-            sumG += data[j][i].g;
-            sumB += data[j][i].b;
-            count++;
-        }
+// Variance around avgColor from the sums of p and p^2:
+// sum((p - a)^2) = sumSq - 2 * a * sum + count * a^2, exact in integers
+static double varianceFromSums(const uint64_t sums[3], const uint64_t sq[3], long long count, Pixel avgColor) {
+    const long long avg[3] = {avgColor.r, avgColor.g, avgColor.b};
+    double var[3];
+    for (int c = 0; c < 3; c++) {
+        long long dev = (long long)sq[c] - 2 * avg[c] * (long long)sums[c] + count * avg[c] * avg[c];
+        var[c] = static_cast<double>(dev) / count;
     }
+    return (var[0] + var[1] + var[2]) / 3.0;
+}
+
+static double madFromSums(const uint64_t sad[3], long long count) {
+    return ((double)sad[0] / count + (double)sad[1] / count + (double)sad[2] / count) / 3.0;
+}
+
+// An empty block keeps min 255 / max 0, exactly as the original pixel loop did
+static double maxDifferenceFromRange(const unsigned char minValue[3], const unsigned char maxValue[3]) {
+    double diffR = maxValue[0] - minValue[0];
+    double diffG = maxValue[1] - minValue[1];
+    double diffB = maxValue[2] - minValue[2];
+    return (diffR + diffG + diffB) / 3.0;
+}
+
+// Block reductions: blocks narrower than a vector stay on the inline scalar
+// loops (most blocks of a deep tree are a few pixels wide), wider ones use
+// the SIMD kernels picked for this CPU (simd.h)
+static inline void blockSum(const Image& image, int x, int y, int xEnd, int yEnd, uint64_t sums[3]) {
+    const Pixel* p = image.row(y) + x;
+    if (xEnd - x < VECTOR_MIN_PIXELS) sumScalar(p, image.stride(), xEnd - x, yEnd - y, sums);
+    else pixelKernels().sum(p, image.stride(), xEnd - x, yEnd - y, sums);
+}
+
+static inline void blockSumSquares(const Image& image, int x, int y, int xEnd, int yEnd, uint64_t sums[3], uint64_t sq[3]) {
+    const Pixel* p = image.row(y) + x;
+    if (xEnd - x < VECTOR_MIN_PIXELS) sumSquaresScalar(p, image.stride(), xEnd - x, yEnd - y, sums, sq);
+    else pixelKernels().sumSquares(p, image.stride(), xEnd - x, yEnd - y, sums, sq);
+}
+
+static inline void blockMinMax(const Image& image, int x, int y, int xEnd, int yEnd, unsigned char minValue[3], unsigned char maxValue[3]) {
+    const Pixel* p = image.row(y) + x;
+    if (xEnd - x < VECTOR_MIN_PIXELS) minMaxScalar(p, image.stride(), xEnd - x, yEnd - y, minValue, maxValue);
+    else pixelKernels().minMax(p, image.stride(), xEnd - x, yEnd - y, minValue, maxValue);
+}
+
+static inline void blockAbsDiff(const Image& image, int x, int y, int xEnd, int yEnd, Pixel center, uint64_t sad[3]) {
+    const Pixel* p = image.row(y) + x;
+    if (xEnd - x < VECTOR_MIN_PIXELS) absDiffScalar(p, image.stride(), xEnd - x, yEnd - y, center, sad);
+    else pixelKernels().absDiff(p, image.stride(), xEnd - x, yEnd - y, center, sad);
+}
+
+// Calculate average color of a block
+Pixel calculateAvgColor(const Image& image, int x, int y, int size) {
+    uint64_t sums[3] = {0, 0, 0};
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+    const long long count = blockPixels(x, y, xEnd, yEnd);
 
-    Pixel avg;
     if (count > 0) {
-        avg.r = static_cast<unsigned char>(sumR / count);
-        avg.g = static_cast<unsigned char>(sumG / count);
-        avg.b = static_cast<unsigned char>(sumB / count);
-    } else {
-        avg.r = avg.g = avg.b = 0;
+        blockSum(image, x, y, xEnd, yEnd, sums);
     }
 
-    return avg;
+    return averageFromSums(sums, count);
+}
+
+// Shannon entropy (bits) of a 256-bin histogram over count samples
+static double histogramEntropy(const int hist[256], long long count) {
+    double entropy = 0.0;
+    for (int i = 0; i < 256; i++) {
+        if (hist[i] > 0) {
+            double probability = (double)hist[i] / count;
+            entropy -= probability * log2(probability);
+        }
+    }
+    return entropy;
 }
 
 // Calculate block statistics for error methods
-BlockStats calculateBlockStats(const vector<vector<Pixel>>& data, int x, int y, int size) {
+BlockStats calculateBlockStats(const Image& image, int x, int y, int size) {
     BlockStats stats;
     long sumR = 0, sumG = 0, sumB = 0;
     int count = 0;
     unsigned char minR = 255, minG = 255, minB = 255;
     unsigned char maxR = 0, maxG = 0, maxB = 0;
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
 
     // First pass - calculate means and min/max
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[0].size(); i++) {
-            sumR += data[j][i].r;
-            sumG += data[j][i].g;
-            sumB += data[j][i].b;
+    for (int j = y; j < yEnd; j++) {
+        const Pixel* row = image.row(j);
+        for (int i = x; i < xEnd; i++) {
+            sumR += row[i].r;
+            sumG += row[i].g;
+            sumB += row[i].b;
             
-            minR = min(minR, data[j][i].r);
-            minG = min(minG, data[j][i].g);
-            minB = min(minB, data[j][i].b);
+            minR = min(minR, row[i].r);
+            minG = min(minG, row[i].g);
+            minB = min(minB, row[i].b);
             
-            maxR = max(maxR, data[j][i].r);
-            maxG = max(maxG, data[j][i].g);
-            maxB = max(maxB, data[j][i].b);
+            maxR = max(maxR, row[i].r);
+            maxG = max(maxG, row[i].g);
+            maxB = max(maxB, row[i].b);
             
             count++;
         }
@@ -95,14 +160,15 @@ BlockStats calculateBlockStats(const vector<vector<Pixel>>& data, int x, int y,
     double sumMadR = 0, sumMadG = 0, sumMadB = 0;
     
     // For entropy calculation
-    map<unsigned char, int> histR, histG, histB;
+    int histR[256] = {0}, histG[256] = {0}, histB[256] = {0};
 
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[0].size(); i++) {
+    for (int j = y; j < yEnd; j++) {
+        const Pixel* row = image.row(j);
+        for (int i = x; i < xEnd; i++) {
             // Variance calculation
-            double diffR = data[j][i].r - stats.meanR;
-            double diffG = data[j][i].g - stats.meanG;
-            double diffB = data[j][i].b - stats.meanB;
+            double diffR = row[i].r - stats.meanR;
+            double diffG = row[i].g - stats.meanG;
+            double diffB = row[i].b - stats.meanB;
             
             sumVarR += diffR * diffR;
             sumVarG += diffG * diffG;
@@ -114,9 +180,9 @@ BlockStats calculateBlockStats(const vector<vector<Pixel>>& data, int x, int y,
             sumMadB += abs(diffB);
             
             // Entropy calculation - count frequencies
-            histR[data[j][i].r]++;
-            histG[data[j][i].g]++;
-            histB[data[j][i].b]++;
+            histR[row[i].r]++;
+            histG[row[i].g]++;
+            histB[row[i].b]++;
         }
     }
 
@@ -129,244 +195,1027 @@ BlockStats calculateBlockStats(const vector<vector<Pixel>>& data, int x, int y,
     stats.madB = sumMadB / count;
     
     // Calculate entropy
-    stats.entropyR = 0;
-    stats.entropyG = 0;
-    stats.entropyB = 0;
-    
-    for (const auto& pair : histR) {
-        double probability = pair.second / static_cast<double>(count);
-        stats.entropyR -= probability * log2(probability);
-    }
-    
-    for (const auto& pair : histG) {
-        double probability = pair.second / static_cast<double>(count);
-        stats.entropyG -= probability * log2(probability);
-    }
-    
-    for (const auto& pair : histB) {
-        double probability = pair.second / static_cast<double>(count);
-        stats.entropyB -= probability * log2(probability);
-    }
+    stats.entropyR = histogramEntropy(histR, count);
+    stats.entropyG = histogramEntropy(histG, count);
+    stats.entropyB = histogramEntropy(histB, count);
 
     return stats;
 }
 
 // Calculate variance error
-double calculateVariance(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor) {
-    double varR = 0.0, varG = 0.0, varB = 0.0;
-    int count = 0;
-    
+double calculateVariance(const Image& image, int x, int y, int size, Pixel avgColor) {
+    uint64_t sums[3] = {0, 0, 0}, sq[3] = {0, 0, 0};
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+    const long long count = blockPixels(x, y, xEnd, yEnd);
+    if (count == 0) return 0.0;
+
     // Hitung varians untuk setiap channel warna
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[j].size(); i++) {
-            double dr = data[j][i].r - avgColor.r;
-            double dg = data[j][i].g - avgColor.g;
-            double db = data[j][i].b - avgColor.b;
-            
-            varR += dr * dr;
-            varG += dg * dg;
-            varB += db * db;
-            count++;
-        }
-    }
-    
-    // Bagi dengan jumlah pixel untuk mendapatkan varians
-    if (count > 0) {
-        varR /= count;
-        varG /= count;
-        varB /= count;
-    }
-    
+    blockSumSquares(image, x, y, xEnd, yEnd, sums, sq);
+
     // Rata-rata varians dari 3 channel
-    return (varR + varG + varB) / 3.0;
+    return varianceFromSums(sums, sq, count, avgColor);
 }
 
 // Calculate Mean Absolute Deviation (MAD) error
-double calculateMAD(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor) {
-    double madR = 0.0, madG = 0.0, madB = 0.0;
-    int count = 0;
-    
+double calculateMAD(const Image& image, int x, int y, int size, Pixel avgColor) {
+    uint64_t sad[3] = {0, 0, 0};
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+    const long long count = blockPixels(x, y, xEnd, yEnd);
+    if (count == 0) return 0.0;
+
     // Hitung MAD untuk setiap channel warna
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[j].size(); i++) {
-            madR += abs(data[j][i].r - avgColor.r);
-            madG += abs(data[j][i].g - avgColor.g);
-            madB += abs(data[j][i].b - avgColor.b);
-            count++;
-        }
-    }
-    
-    // Bagi dengan jumlah pixel untuk mendapatkan MAD
-    if (count > 0) {
-        madR /= count;
-        madG /= count;
-        madB /= count;
-    }
-    
+    blockAbsDiff(image, x, y, xEnd, yEnd, avgColor, sad);
+
     // Rata-rata MAD dari 3 channel
-    return (madR + madG + madB) / 3.0;
+    return madFromSums(sad, count);
 }
 
-double calculateMaxDifference(vector<vector<Pixel>>& data, int x, int y, int size) {
-    unsigned char minR = 255, minG = 255, minB = 255;
-    unsigned char maxR = 0, maxG = 0, maxB = 0;
-    
+double calculateMaxDifference(const Image& image, int x, int y, int size) {
+    unsigned char minValue[3] = {255, 255, 255};
+    unsigned char maxValue[3] = {0, 0, 0};
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+
     // Cari nilai min dan max untuk setiap channel
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[j].size(); i++) {
-            // Update min values
-            minR = min(minR, data[j][i].r);
-            minG = min(minG, data[j][i].g);
-            minB = min(minB, data[j][i].b);
-            
-            // Update max values
-            maxR = max(maxR, data[j][i].r);
-            maxG = max(maxG, data[j][i].g);
-            maxB = max(maxB, data[j][i].b);
-        }
+    if (blockPixels(x, y, xEnd, yEnd) > 0) {
+        blockMinMax(image, x, y, xEnd, yEnd, minValue, maxValue);
     }
-    
-    // Hitung selisih max-min untuk tiap channel
-    double diffR = maxR - minR;
-    double diffG = maxG - minG;
-    double diffB = maxB - minB;
-    
-    // Rata-rata selisih dari 3 channel
-    return (diffR + diffG + diffB) / 3.0;
+
+    // Rata-rata selisih max-min dari 3 channel
+    return maxDifferenceFromRange(minValue, maxValue);
 }
 
-double calculateEntropy(vector<vector<Pixel>>& data, int x, int y, int size) {
+double calculateEntropy(const Image& image, int x, int y, int size) {
     // Hitung histogram untuk setiap channel
-    const int BINS = 256;
-    vector<int> histR(BINS, 0), histG(BINS, 0), histB(BINS, 0);
+    int histR[256], histG[256], histB[256];
+    memset(histR, 0, sizeof(histR));
+    memset(histG, 0, sizeof(histG));
+    memset(histB, 0, sizeof(histB));
     int totalPixels = 0;
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
     
-    for (int j = y; j < y + size && j < data.size(); j++) {
-        for (int i = x; i < x + size && i < data[j].size(); i++) {
-            histR[data[j][i].r]++;
-            histG[data[j][i].g]++;
-            histB[data[j][i].b]++;
+    for (int j = y; j < yEnd; j++) {
+        const Pixel* row = image.row(j);
+        for (int i = x; i < xEnd; i++) {
+            histR[row[i].r]++;
+            histG[row[i].g]++;
+            histB[row[i].b]++;
             totalPixels++;
         }
     }
     
     // Hitung entropy untuk masing-masing channel
-    double entropyR = 0.0, entropyG = 0.0, entropyB = 0.0;
-    for (int i = 0; i < BINS; i++) {
-        if (histR[i] > 0) {
-            double pR = (double)histR[i] / totalPixels;
-            entropyR -= pR * log2(pR);
+    double entropyR = histogramEntropy(histR, totalPixels);
+    double entropyG = histogramEntropy(histG, totalPixels);
+    double entropyB = histogramEntropy(histB, totalPixels);
+    
+    // Rata-rata entropy dari ketiga channel
+    return (entropyR + entropyG + entropyB) / 3.0;
+}
+
+// Build summed-area tables for the whole image (one pass, O(N))
+IntegralImage buildIntegralImage(const Image& image, bool withSquares, bool withRanges) {
+    IntegralImage integral;
+    if (withRanges) {
+        TraceScope scope("min/max pyramid");
+        integral.ranges = buildMinMaxPyramid(image);
+    }
+    integral.height = image.height();
+    integral.width = image.width();
+
+    const int w = integral.width + 1;
+    integral.sum.assign((size_t)w * (integral.height + 1), IntegralImage::Sum{0, 0, 0});
+    if (withSquares) {
+        integral.sumSq.assign((size_t)w * (integral.height + 1), IntegralImage::SumSq{0, 0, 0});
+    }
+
+    for (int j = 0; j < integral.height; j++) {
+        // Running totals of the current row, added onto the row above
+        uint32_t rowR = 0, rowG = 0, rowB = 0;
+        uint64_t rowSqR = 0, rowSqG = 0, rowSqB = 0;
+        const IntegralImage::Sum* above = &integral.sum[(size_t)j * w];
+        IntegralImage::Sum* current = &integral.sum[(size_t)(j + 1) * w];
+        const Pixel* row = image.row(j);
+
+        for (int i = 0; i < integral.width; i++) {
+            const Pixel& p = row[i];
+            rowR += p.r;
+            rowG += p.g;
+            rowB += p.b;
+            current[i + 1].r = above[i + 1].r + rowR;
+            current[i + 1].g = above[i + 1].g + rowG;
+            current[i + 1].b = above[i + 1].b + rowB;
         }
-        if (histG[i] > 0) {
-            double pG = (double)histG[i] / totalPixels;
-            entropyG -= pG * log2(pG);
+
+        if (!withSquares) continue;
+
+        const IntegralImage::SumSq* aboveSq = &integral.sumSq[(size_t)j * w];
+        IntegralImage::SumSq* currentSq = &integral.sumSq[(size_t)(j + 1) * w];
+        for (int i = 0; i < integral.width; i++) {
+            const Pixel& p = row[i];
+            rowSqR += p.r * p.r;
+            rowSqG += p.g * p.g;
+            rowSqB += p.b * p.b;
+            currentSq[i + 1].r = aboveSq[i + 1].r + rowSqR;
+            currentSq[i + 1].g = aboveSq[i + 1].g + rowSqG;
+            currentSq[i + 1].b = aboveSq[i + 1].b + rowSqB;
         }
-        if (histB[i] > 0) {
-            double pB = (double)histB[i] / totalPixels;
-            entropyB -= pB * log2(pB);
+    }
+
+    return integral;
+}
+
+// Each level from the one below: level 1 straight from the pixels, then every
+// block from its (up to) four quadrants. O(N) to build, and about 2 bytes
+// per pixel: N/4 + N/16 + ... ranges of 6 bytes.
+MinMaxPyramid buildMinMaxPyramid(const Image& image) {
+    MinMaxPyramid pyramid;
+    pyramid.width = image.width();
+    pyramid.height = image.height();
+    pyramid.levels.emplace_back(); // Level 0, never stored
+
+    for (int side = 2; side / 2 < max(pyramid.width, pyramid.height); side *= 2) {
+        MinMaxPyramid::Level level;
+        level.width = (pyramid.width + side - 1) / side;
+        level.height = (pyramid.height + side - 1) / side;
+        level.ranges.resize((size_t)level.width * level.height);
+        const MinMaxPyramid::Level& below = pyramid.levels.back();
+
+        for (int j = 0; j < level.height; j++) {
+            for (int i = 0; i < level.width; i++) {
+                MinMaxPyramid::Range& range = level.ranges[(size_t)j * level.width + i];
+                unsigned char minValue[3] = {255, 255, 255};
+                unsigned char maxValue[3] = {0, 0, 0};
+                if (side == 2) {
+                    const int xEnd = min(2 * i + 2, pyramid.width);
+                    const int yEnd = min(2 * j + 2, pyramid.height);
+                    minMaxScalar(image.row(2 * j) + 2 * i, image.stride(), xEnd - 2 * i, yEnd - 2 * j, minValue, maxValue);
+                } else {
+                    const int xEnd = min(2 * i + 2, below.width);
+                    const int yEnd = min(2 * j + 2, below.height);
+                    for (int y = 2 * j; y < yEnd; y++) {
+                        for (int x = 2 * i; x < xEnd; x++) {
+                            const MinMaxPyramid::Range& part = below.ranges[(size_t)y * below.width + x];
+                            for (int c = 0; c < 3; c++) {
+                                minValue[c] = min(minValue[c], part.minValue[c]);
+                                maxValue[c] = max(maxValue[c], part.maxValue[c]);
+                            }
+                        }
+                    }
+                }
+                for (int c = 0; c < 3; c++) {
+                    range.minValue[c] = minValue[c];
+                    range.maxValue[c] = maxValue[c];
+                }
+            }
         }
+        pyramid.levels.push_back(move(level));
+    }
+
+    return pyramid;
+}
+
+size_t MinMaxPyramid::bytes() const {
+    size_t total = 0;
+    for (const Level& level : levels) {
+        total += level.ranges.size() * sizeof(Range);
+    }
+    return total;
+}
+
+// Same result as calculateMaxDifference on the pixels, including -255 for a
+// block outside the image. A block larger than the top level can only be
+// the root, whose range is the top level's single entry.
+double calculateMaxDifference(const MinMaxPyramid& pyramid, int x, int y, int size) {
+    const unsigned char emptyMin[3] = {255, 255, 255};
+    const unsigned char emptyMax[3] = {0, 0, 0};
+    if (x >= pyramid.width || y >= pyramid.height) {
+        return maxDifferenceFromRange(emptyMin, emptyMax);
+    }
+    if (size <= 1 || pyramid.levels.size() == 1) return 0.0; // A single pixel
+
+    size_t k = 0;
+    while ((1 << (k + 1)) <= size) k++;
+    k = min(k, pyramid.levels.size() - 1);
+    const MinMaxPyramid::Level& level = pyramid.levels[k];
+    const MinMaxPyramid::Range& range = level.ranges[(size_t)(y >> k) * level.width + (x >> k)];
+    return maxDifferenceFromRange(range.minValue, range.maxValue);
+}
+
+// Largest rectangle whose channel sum cannot wrap a 32-bit table (255 * 2^24 < 2^32)
+static const long long MAX_SUM_AREA = 1LL << 24;
+
+// Per-channel sum over [x0, x1) x [y0, y1). Rectangles that could wrap the
+// 32-bit tables are split in half, so the result is always exact.
+static void rectSum(const IntegralImage& integral, int x0, int y0, int x1, int y1, long long out[3]) {
+    if ((long long)(x1 - x0) * (y1 - y0) > MAX_SUM_AREA) {
+        long long a[3], b[3];
+        if (x1 - x0 >= y1 - y0) {
+            int mid = x0 + (x1 - x0) / 2;
+            rectSum(integral, x0, y0, mid, y1, a);
+            rectSum(integral, mid, y0, x1, y1, b);
+        } else {
+            int mid = y0 + (y1 - y0) / 2;
+            rectSum(integral, x0, y0, x1, mid, a);
+            rectSum(integral, x0, mid, x1, y1, b);
+        }
+        for (int c = 0; c < 3; c++) out[c] = a[c] + b[c];
+        return;
+    }
+
+    const size_t w = integral.width + 1;
+    const IntegralImage::Sum& A = integral.sum[y0 * w + x0];
+    const IntegralImage::Sum& B = integral.sum[y0 * w + x1];
+    const IntegralImage::Sum& C = integral.sum[y1 * w + x0];
+    const IntegralImage::Sum& D = integral.sum[y1 * w + x1];
+    // Unsigned wrap-around cancels out as long as the true sum fits in 32 bits
+    out[0] = (uint32_t)(D.r - B.r - C.r + A.r);
+    out[1] = (uint32_t)(D.g - B.g - C.g + A.g);
+    out[2] = (uint32_t)(D.b - B.b - C.b + A.b);
+}
+
+// Clip a block to the image, returns the number of pixels inside
+static long long clipBlock(const IntegralImage& integral, int x, int y, int size, int& x0, int& y0, int& x1, int& y1) {
+    x0 = max(x, 0);
+    y0 = max(y, 0);
+    x1 = min(x + size, integral.width);
+    y1 = min(y + size, integral.height);
+    if (x1 <= x0 || y1 <= y0) return 0;
+    return (long long)(x1 - x0) * (y1 - y0);
+}
+
+// Average color of a block in O(1) using the summed-area tables
+Pixel calculateAvgColor(const IntegralImage& integral, int x, int y, int size) {
+    int x0, y0, x1, y1;
+    long long count = clipBlock(integral, x, y, size, x0, y0, x1, y1);
+
+    Pixel avg;
+    if (count > 0) {
+        long long sums[3];
+        rectSum(integral, x0, y0, x1, y1, sums);
+        avg.r = static_cast<unsigned char>(sums[0] / count);
+        avg.g = static_cast<unsigned char>(sums[1] / count);
+        avg.b = static_cast<unsigned char>(sums[2] / count);
+    } else {
+        avg.r = avg.g = avg.b = 0;
+    }
+
+    return avg;
+}
+
+// Variance error in O(1): sum((p - a)^2) = sumSq - 2 * a * sum + count * a^2.
+// Every term is an exact integer, so the result matches the pixel loop exactly.
+double calculateVariance(const IntegralImage& integral, int x, int y, int size, Pixel avgColor) {
+    int x0, y0, x1, y1;
+    long long count = clipBlock(integral, x, y, size, x0, y0, x1, y1);
+    if (count == 0) return 0.0;
+
+    long long sums[3];
+    rectSum(integral, x0, y0, x1, y1, sums);
+
+    const size_t w = integral.width + 1;
+    const IntegralImage::SumSq& A = integral.sumSq[y0 * w + x0];
+    const IntegralImage::SumSq& B = integral.sumSq[y0 * w + x1];
+    const IntegralImage::SumSq& C = integral.sumSq[y1 * w + x0];
+    const IntegralImage::SumSq& D = integral.sumSq[y1 * w + x1];
+    long long sq[3] = {
+        (long long)(D.r - B.r - C.r + A.r),
+        (long long)(D.g - B.g - C.g + A.g),
+        (long long)(D.b - B.b - C.b + A.b)
+    };
+    const long long avg[3] = {avgColor.r, avgColor.g, avgColor.b};
+
+    double var[3];
+    for (int c = 0; c < 3; c++) {
+        long long dev = sq[c] - 2 * avg[c] * sums[c] + count * avg[c] * avg[c];
+        var[c] = static_cast<double>(dev) / count;
+    }
+
+    // Rata-rata varians dari 3 channel
+    return (var[0] + var[1] + var[2]) / 3.0;
+}
+
+// Fused kernel: the average color and the selected metric in one scan of the
+// block. Variance follows from the sums of p and p^2, Max Pixel Difference
+// takes min/max alongside the sums, Entropy gets its sums from the histogram,
+// and only MAD takes a second scan because it is measured around the average.
+template <int Method>
+static double fusedBlockError(const Image& image, int x, int y, int size, Pixel& avgColor) {
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+    const long long count = blockPixels(x, y, xEnd, yEnd);
+
+    uint64_t sums[3] = {0, 0, 0};
+    uint64_t sq[3] = {0, 0, 0};
+    unsigned char minValue[3] = {255, 255, 255};
+    unsigned char maxValue[3] = {0, 0, 0};
+    int histR[256], histG[256], histB[256];
+
+    if (Method == 4) {
+        memset(histR, 0, sizeof(histR));
+        memset(histG, 0, sizeof(histG));
+        memset(histB, 0, sizeof(histB));
+        for (int j = y; j < yEnd; j++) {
+            const Pixel* row = image.row(j);
+            for (int i = x; i < xEnd; i++) {
+                histR[row[i].r]++;
+                histG[row[i].g]++;
+                histB[row[i].b]++;
+            }
+        }
+        for (int v = 0; v < 256; v++) {
+            sums[0] += (uint64_t)v * histR[v];
+            sums[1] += (uint64_t)v * histG[v];
+            sums[2] += (uint64_t)v * histB[v];
+        }
+    } else if (count > 0) {
+        if (Method == 1) {
+            blockSumSquares(image, x, y, xEnd, yEnd, sums, sq);
+        } else if (Method == 3 && xEnd - x < VECTOR_MIN_PIXELS) {
+            // Narrow block: sums and range in the same scalar loop
+            unsigned char minR = 255, minG = 255, minB = 255;
+            unsigned char maxR = 0, maxG = 0, maxB = 0;
+            for (int j = y; j < yEnd; j++) {
+                const Pixel* row = image.row(j);
+                for (int i = x; i < xEnd; i++) {
+                    const Pixel p = row[i];
+                    sums[0] += p.r;
+                    sums[1] += p.g;
+                    sums[2] += p.b;
+                    minR = min(minR, p.r); maxR = max(maxR, p.r);
+                    minG = min(minG, p.g); maxG = max(maxG, p.g);
+                    minB = min(minB, p.b); maxB = max(maxB, p.b);
+                }
+            }
+            minValue[0] = minR; minValue[1] = minG; minValue[2] = minB;
+            maxValue[0] = maxR; maxValue[1] = maxG; maxValue[2] = maxB;
+        } else {
+            blockSum(image, x, y, xEnd, yEnd, sums);
+            if (Method == 3) {
+                blockMinMax(image, x, y, xEnd, yEnd, minValue, maxValue);
+            }
+        }
+    }
+    avgColor = averageFromSums(sums, count);
+
+    if (Method == 3) {
+        return maxDifferenceFromRange(minValue, maxValue);
+    }
+    if (Method == 4) {
+        return (histogramEntropy(histR, count) + histogramEntropy(histG, count) + histogramEntropy(histB, count)) / 3.0;
+    }
+    if (count == 0) return 0.0;
+
+    if (Method == 2) {
+        // Second scan, around the average
+        uint64_t sad[3] = {0, 0, 0};
+        blockAbsDiff(image, x, y, xEnd, yEnd, avgColor, sad);
+        return madFromSums(sad, count);
+    }
+
+    return varianceFromSums(sums, sq, count, avgColor);
+}
+
+// Results are identical to calculateAvgColor followed by calculateError
+double calculateAvgColorAndError(const Image& image, int x, int y, int size, int method, Pixel& avgColor) {
+    switch (method) {
+        case 2: return fusedBlockError<2>(image, x, y, size, avgColor);
+        case 3: return fusedBlockError<3>(image, x, y, size, avgColor);
+        case 4: return fusedBlockError<4>(image, x, y, size, avgColor);
+        default: return fusedBlockError<1>(image, x, y, size, avgColor); // Variance
     }
-    
-    // Rata-rata entropy dari ketiga channel
-    return (entropyR + entropyG + entropyB) / 3.0;
 }
 
 // Implementasi calculateError di quadtree.cpp
-double calculateError(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor, int method) {
+double calculateError(const Image& image, int x, int y, int size, Pixel avgColor, int method, const IntegralImage* integral) {
     switch (method) {
         case 1: // Variance
-            return calculateVariance(data, x, y, size, avgColor);
+            if (integral && !integral->sumSq.empty()) {
+                return calculateVariance(*integral, x, y, size, avgColor);
+            }
+            return calculateVariance(image, x, y, size, avgColor);
         case 2: // Mean Absolute Deviation (MAD)
-            return calculateMAD(data, x, y, size, avgColor);
+            return calculateMAD(image, x, y, size, avgColor);
         case 3: // Max Pixel Difference
-            return calculateMaxDifference(data, x, y, size);
+            if (integral && !integral->ranges.levels.empty()) {
+                return calculateMaxDifference(integral->ranges, x, y, size);
+            }
+            return calculateMaxDifference(image, x, y, size);
         case 4: // Entropy
-            return calculateEntropy(data, x, y, size);
+            return calculateEntropy(image, x, y, size);
         default:
-            return calculateVariance(data, x, y, size, avgColor); // Default to variance
+            return calculateVariance(image, x, y, size, avgColor); // Default to variance
+    }
+}
+
+// Count one metric evaluation for --trace, with the block's pixels when it reads them
+static inline void traceBlockMetric(const Image& image, int x, int y, int size, int method, bool scanned) {
+    if (tracing()) {
+        traceMetric(method, scanned ? blockPixels(x, y, min(x + size, image.width()), min(y + size, image.height())) : 0);
+    }
+}
+
+// Average color and error of a block. The summed-area tables answer Variance
+// in O(1), with the min/max pyramid Max Pixel Difference too, and they give
+// MAD its mean for free; everything else goes through the fused
+// single-pass kernel.
+double calculateBlockError(const Image& image, int x, int y, int size, int method, const IntegralImage* integral, Pixel& avgColor) {
+    bool variance = method < 2 || method > 4;
+    bool ranges = method == 3 && integral && !integral->ranges.levels.empty();
+    if (integral && ((variance && !integral->sumSq.empty()) || method == 2 || ranges)) {
+        traceBlockMetric(image, x, y, size, method, method == 2);
+        avgColor = calculateAvgColor(*integral, x, y, size);
+        return calculateError(image, x, y, size, avgColor, method, integral);
     }
+    traceBlockMetric(image, x, y, size, method, true);
+    return calculateAvgColorAndError(image, x, y, size, method, avgColor);
+}
+
+// Compute a node's average color and decide whether its block must be split
+static bool evaluateNode(const Image& image, const IntegralImage* integral, QuadTreeNode* node, double threshold, int minBlockSize, int method) {
+    const int x = node->x, y = node->y, size = node->size;
+    double error = calculateBlockError(image, x, y, size, method, integral, node->avgColor);
+    return error > threshold && size > minBlockSize && size / 2 >= minBlockSize;
+}
+
+// Whether a block has any pixels. The root is padded up to a power of two,
+// so quadrants past the right or bottom edge get no node at all: their
+// child pointer stays null and nothing below them is evaluated.
+static inline bool blockInImage(int x, int y, int width, int height) {
+    return x < width && y < height;
 }
 
 // Build QuadTree using divide and conquer approach
-QuadTreeNode* buildQuadTree(const vector<vector<Pixel>>& data, int x, int y, int size, double threshold, int minBlockSize, int method, int depth) {
-    QuadTreeNode* node = new QuadTreeNode(x, y, size);
+QuadTreeNode* buildQuadTree(const Image& image, NodeArena& arena, int x, int y, int size, double threshold, int minBlockSize, int method, const IntegralImage* integral, int depth, TreeStats* stats) {
+    QuadTreeNode* node = arena.create(x, y, size);
+    bool split = evaluateNode(image, integral, node, threshold, minBlockSize, method);
+    if (stats) {
+        stats->add(depth, !split);
+    }
 
-    // Hitung warna rata-rata terlebih dahulu
-    Pixel avgColor = calculateAvgColor(data, x, y, size);
-    node->avgColor = avgColor;
+    if (split) {
+        node->isLeaf = false;
+        int halfSize = size / 2;
+
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        for (int i = 0; i < 4; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            if (blockInImage(cx, cy, image.width(), image.height())) {
+                node->children[i] = buildQuadTree(image, arena, cx, cy, halfSize, threshold, minBlockSize, method, integral, depth + 1, stats);
+            }
+        }
+    }
+
+    return node;
+}
+
+// Blocks smaller than this are built serially by the task that reached them
+static const int PARALLEL_CUTOFF = 256;
 
-    // Hitung error dengan parameter yang benar
-    double error = calculateError(const_cast<vector<vector<Pixel>>&>(data), x, y, size, avgColor, method);
+// Read-only state shared by all tasks of one parallel build
+struct ParallelBuild {
+    const Image& image;
+    const IntegralImage* integral;
+    double threshold;
+    int minBlockSize;
+    int method;
+    ThreadPool& pool;
+    vector<NodeArena>& arenas;
+    vector<TreeStats>& stats; // Per worker like the arenas, merged after the build
+};
 
-    if (error > threshold && size > minBlockSize && size / 2 >= minBlockSize) {
-    node->isLeaf = false;
-    int halfSize = size / 2;
+// Same recursion as buildQuadTree, but the four quadrants of large blocks are
+// forked as pool tasks. Every node is evaluated exactly as in the serial
+// build, so the two trees are identical.
+static QuadTreeNode* buildQuadTreeParallel(const ParallelBuild& build, int x, int y, int size, int depth) {
+    NodeArena& arena = build.arenas[build.pool.currentWorker()];
+    TreeStats& stats = build.stats[build.pool.currentWorker()];
+    if (size < PARALLEL_CUTOFF) {
+        TraceScope scope("subtree");
+        return buildQuadTree(build.image, arena, x, y, size, build.threshold, build.minBlockSize, build.method, build.integral, depth, &stats);
+    }
+
+    QuadTreeNode* node = arena.create(x, y, size);
+    bool split = evaluateNode(build.image, build.integral, node, build.threshold, build.minBlockSize, build.method);
+    stats.add(depth, !split);
+
+    if (split) {
+        node->isLeaf = false;
+        int halfSize = size / 2;
 
-    node->children[0] = buildQuadTree(data, x, y, halfSize, threshold, minBlockSize, method, depth + 1);
-    node->children[1] = buildQuadTree(data, x + halfSize, y, halfSize, threshold, minBlockSize, method, depth + 1);
-    node->children[2] = buildQuadTree(data, x, y + halfSize, halfSize, threshold, minBlockSize, method, depth + 1);
-    node->children[3] = buildQuadTree(data, x + halfSize, y + halfSize, halfSize, threshold, minBlockSize, method, depth + 1);
+        const int width = build.image.width(), height = build.image.height();
+        TaskGroup group(build.pool);
+        if (blockInImage(x + halfSize, y, width, height)) {
+            group.run([&]() { node->children[1] = buildQuadTreeParallel(build, x + halfSize, y, halfSize, depth + 1); });
+        }
+        if (blockInImage(x, y + halfSize, width, height)) {
+            group.run([&]() { node->children[2] = buildQuadTreeParallel(build, x, y + halfSize, halfSize, depth + 1); });
+        }
+        if (blockInImage(x + halfSize, y + halfSize, width, height)) {
+            group.run([&]() { node->children[3] = buildQuadTreeParallel(build, x + halfSize, y + halfSize, halfSize, depth + 1); });
+        }
+        node->children[0] = buildQuadTreeParallel(build, x, y, halfSize, depth + 1);
+        group.wait();
     }
 
     return node;
+}
+
+// Build a fresh tree into this object's arenas, reusing memory from the previous build
+void QuadTree::build(const Image& image, int size, double threshold, int minBlockSize, int method, const IntegralImage* integral, ThreadPool* pool) {
+    clear();
+
+    size_t arenaCount = pool ? pool->size() : 1;
+    while (arenas.size() < arenaCount) {
+        arenas.emplace_back();
     }
 
-// Reconstruct the image from the QuadTree
-void reconstructImage(const QuadTreeNode* node, vector<vector<Pixel>>& outputImage) {
-    if (!node) return;
-    
-    // If this is a leaf node, fill the corresponding area with the average color
-    if (node->isLeaf) {
-        for (int j = node->y; j < node->y + node->size && j < outputImage.size(); j++) {
-            for (int i = node->x; i < node->x + node->size && i < outputImage[0].size(); i++) {
-                outputImage[j][i] = node->avgColor;
+    if (!pool || pool->size() == 1) {
+        root = buildQuadTree(image, arenas[0], 0, 0, size, threshold, minBlockSize, method, integral, 0, &stats);
+        traceCount(TRACE_NODES_CREATED, stats.nodes);
+        return;
+    }
+
+    vector<TreeStats> workerStats(arenaCount);
+    ParallelBuild build = {image, integral, threshold, minBlockSize, method, *pool, arenas, workerStats};
+    root = buildQuadTreeParallel(build, 0, 0, size, 0);
+    for (const TreeStats& part : workerStats) {
+        stats.merge(part);
+    }
+    traceCount(TRACE_NODES_CREATED, stats.nodes);
+}
+
+// Sorted union of two sparse histograms, counts of equal values added
+static void mergeBins(const vector<BlockSummary::Bin>& a, const vector<BlockSummary::Bin>& b, vector<BlockSummary::Bin>& out) {
+    out.clear();
+    size_t i = 0, j = 0;
+    while (i < a.size() && j < b.size()) {
+        if (a[i].value < b[j].value) out.push_back(a[i++]);
+        else if (b[j].value < a[i].value) out.push_back(b[j++]);
+        else {
+            out.push_back(BlockSummary::Bin{a[i].value, a[i].count + b[j].count});
+            i++;
+            j++;
+        }
+    }
+    out.insert(out.end(), a.begin() + i, a.end());
+    out.insert(out.end(), b.begin() + j, b.end());
+}
+
+int BlockSummary::partsFor(int method) {
+    switch (method) {
+        case 2: return SUMS | HISTOGRAM; // MAD
+        case 3: return SUMS | RANGE;     // Max Pixel Difference
+        case 4: return SUMS | HISTOGRAM; // Entropy
+        default: return SUMS | SQUARES;  // Variance
+    }
+}
+
+// Empty summary keeping the given parts; histogram memory is kept for reuse
+void BlockSummary::clear(int keep) {
+    parts = keep;
+    count = 0;
+    for (int c = 0; c < 3; c++) {
+        sums[c] = sumSq[c] = 0;
+        minValue[c] = 255;
+        maxValue[c] = 0;
+        hist[c].clear();
+    }
+}
+
+void BlockSummary::merge(const BlockSummary& other) {
+    count += other.count;
+    for (int c = 0; c < 3; c++) {
+        sums[c] += other.sums[c];
+        sumSq[c] += other.sumSq[c];
+        minValue[c] = min(minValue[c], other.minValue[c]);
+        maxValue[c] = max(maxValue[c], other.maxValue[c]);
+    }
+    if (parts & HISTOGRAM) {
+        static thread_local vector<Bin> merged;
+        for (int c = 0; c < 3; c++) {
+            if (other.hist[c].empty()) continue;
+            mergeBins(hist[c], other.hist[c], merged);
+            hist[c].swap(merged);
+        }
+    }
+}
+
+// Blocks up to this many pixels build their histograms by sorting instead of
+// clearing and scanning 3 x 256 counters
+static const int SMALL_HISTOGRAM_PIXELS = 64;
+
+// Summary of a block from its pixels. A histogram already holds every other
+// part, so with HISTOGRAM the block is read once and the rest derived.
+void calculateBlockSummary(const Image& image, int x, int y, int size, BlockSummary& summary) {
+    const int xEnd = min(x + size, image.width());
+    const int yEnd = min(y + size, image.height());
+    const int parts = summary.parts;
+    summary.clear(parts);
+    summary.count = blockPixels(x, y, xEnd, yEnd);
+    if (summary.count == 0) return;
+    traceCount(TRACE_PIXELS_SCANNED, summary.count);
+
+    if (!(parts & BlockSummary::HISTOGRAM)) {
+        if (parts & BlockSummary::SQUARES) {
+            blockSumSquares(image, x, y, xEnd, yEnd, summary.sums, summary.sumSq);
+        } else {
+            blockSum(image, x, y, xEnd, yEnd, summary.sums);
+        }
+        if (parts & BlockSummary::RANGE) {
+            blockMinMax(image, x, y, xEnd, yEnd, summary.minValue, summary.maxValue);
+        }
+        return;
+    }
+
+    if (summary.count <= SMALL_HISTOGRAM_PIXELS) {
+        // Few pixels: sort each channel's values and count the runs
+        unsigned char values[3][SMALL_HISTOGRAM_PIXELS];
+        int n = 0;
+        for (int j = y; j < yEnd; j++) {
+            const Pixel* row = image.row(j);
+            for (int i = x; i < xEnd; i++, n++) {
+                values[0][n] = row[i].r;
+                values[1][n] = row[i].g;
+                values[2][n] = row[i].b;
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            sort(values[c], values[c] + n);
+            for (int k = 0; k < n; k++) {
+                if (summary.hist[c].empty() || summary.hist[c].back().value != values[c][k]) {
+                    summary.hist[c].push_back(BlockSummary::Bin{values[c][k], 0});
+                }
+                summary.hist[c].back().count++;
+            }
+        }
+    } else {
+        // Dense counts, compacted to the values that occur
+        int hist[3][256];
+        memset(hist, 0, sizeof(hist));
+        for (int j = y; j < yEnd; j++) {
+            const Pixel* row = image.row(j);
+            for (int i = x; i < xEnd; i++) {
+                hist[0][row[i].r]++;
+                hist[1][row[i].g]++;
+                hist[2][row[i].b]++;
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                if (hist[c][v] > 0) {
+                    summary.hist[c].push_back(BlockSummary::Bin{(unsigned char)v, (uint32_t)hist[c][v]});
+                }
+            }
+        }
+    }
+
+    for (int c = 0; c < 3; c++) {
+        for (const BlockSummary::Bin& bin : summary.hist[c]) {
+            summary.sums[c] += (uint64_t)bin.value * bin.count;
+            summary.sumSq[c] += (uint64_t)bin.value * bin.value * bin.count;
+        }
+        summary.minValue[c] = summary.hist[c].front().value;
+        summary.maxValue[c] = summary.hist[c].back().value;
+    }
+}
+
+// Metrics from a summary. Each gives exactly what the pixel version does for
+// the same block: the integer parts are equal, and histogram bins are
+// visited in value order just like the dense 256-bin loops.
+Pixel calculateAvgColor(const BlockSummary& summary) {
+    return averageFromSums(summary.sums, summary.count);
+}
+
+double calculateVariance(const BlockSummary& summary, Pixel avgColor) {
+    if (summary.count == 0) return 0.0;
+    return varianceFromSums(summary.sums, summary.sumSq, summary.count, avgColor);
+}
+
+double calculateMAD(const BlockSummary& summary, Pixel avgColor) {
+    if (summary.count == 0) return 0.0;
+    const int avg[3] = {avgColor.r, avgColor.g, avgColor.b};
+    uint64_t sad[3] = {0, 0, 0};
+    for (int c = 0; c < 3; c++) {
+        for (const BlockSummary::Bin& bin : summary.hist[c]) {
+            sad[c] += (uint64_t)bin.count * abs(bin.value - avg[c]);
+        }
+    }
+    return madFromSums(sad, summary.count);
+}
+
+double calculateMaxDifference(const BlockSummary& summary) {
+    return maxDifferenceFromRange(summary.minValue, summary.maxValue);
+}
+
+double calculateEntropy(const BlockSummary& summary) {
+    double entropy[3] = {0.0, 0.0, 0.0};
+    for (int c = 0; c < 3; c++) {
+        for (const BlockSummary::Bin& bin : summary.hist[c]) {
+            double probability = (double)bin.count / summary.count;
+            entropy[c] -= probability * log2(probability);
+        }
+    }
+    return (entropy[0] + entropy[1] + entropy[2]) / 3.0;
+}
+
+// The summary must hold BlockSummary::partsFor(method)
+double calculateError(const BlockSummary& summary, Pixel avgColor, int method) {
+    traceMetric(method, 0);
+    switch (method) {
+        case 2: return calculateMAD(summary, avgColor);
+        case 3: return calculateMaxDifference(summary);
+        case 4: return calculateEntropy(summary);
+        default: return calculateVariance(summary, avgColor);
+    }
+}
+
+// State of one bottom-up build: per-depth slots for the four quadrants'
+// summaries, reused by every block at that depth. Pixels come from image,
+// whose pixel (0, 0) is at (originX, originY) of the full width x height
+// picture. A tiled build starts without an image and reads each block of
+// tileSize from the reader when the recursion reaches it.
+struct BottomUpBuild {
+    const Image* image;
+    int originX, originY;
+    int width, height;
+    PpmReader* reader;
+    int tileSize;
+    double threshold;
+    int minBlockSize;
+    int method;
+    NodeArena& arena;
+    vector<array<BlockSummary, 4>> quadrants;
+    bool failed;
+};
+
+// Post-order build: a block's summary is the merge of its quadrants', which
+// are built first, so every pixel is read once at the smallest block size.
+// When the block then turns out not to need splitting, the quadrants' nodes
+// are dropped by rewinding the arena to where they started.
+static QuadTreeNode* buildBottomUp(BottomUpBuild& build, int x, int y, int size, int depth, BlockSummary& summary) {
+    const bool canSplit = size > build.minBlockSize && size / 2 >= build.minBlockSize;
+    const bool empty = x >= build.width || y >= build.height;
+    const int halfSize = size / 2;
+    const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+
+    if (!build.image && !empty && (size <= build.tileSize || !canSplit)) {
+        // Tiled build: this block's pixels are all that is resident below here
+        Image tile;
+        {
+            TraceScope scope("read tile");
+            tile = build.reader->readRegion(x, y, size, size);
+        }
+        if (tile.empty()) {
+            build.failed = true;
+            tile = Image(min(size, build.width - x), min(size, build.height - y));
+        }
+        build.image = &tile;
+        build.originX = x;
+        build.originY = y;
+        QuadTreeNode* node = buildBottomUp(build, x, y, size, depth, summary);
+        build.image = nullptr;
+        return node;
+    }
+
+    NodeArena::Mark mark = build.arena.mark();
+    QuadTreeNode* children[4] = {nullptr, nullptr, nullptr, nullptr};
+    summary.parts = BlockSummary::partsFor(build.method);
+
+    if (canSplit && !empty) {
+        array<BlockSummary, 4>& parts = build.quadrants[depth];
+        summary.clear(summary.parts);
+        for (int i = 0; i < 4; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            if (blockInImage(cx, cy, build.width, build.height)) {
+                children[i] = buildBottomUp(build, cx, cy, halfSize, depth + 1, parts[i]);
+                summary.merge(parts[i]);
             }
         }
+    } else if (empty) {
+        summary.clear(summary.parts);
     } else {
-        // Otherwise, recursively process children
+        calculateBlockSummary(*build.image, x - build.originX, y - build.originY, size, summary);
+    }
+
+    Pixel avgColor = calculateAvgColor(summary);
+    double error = calculateError(summary, avgColor, build.method);
+    bool split = error > build.threshold && canSplit && !empty;
+
+    if (!split) {
+        build.arena.rewind(mark);
+    }
+
+    QuadTreeNode* node = build.arena.create(x, y, size);
+    node->avgColor = avgColor;
+    if (split) {
+        node->isLeaf = false;
         for (int i = 0; i < 4; i++) {
-            reconstructImage(node->children[i], outputImage);
+            node->children[i] = children[i];
         }
     }
+    return node;
 }
 
-// Save the reconstructed image to a file
-bool saveQuadTreeImage(const string& filename, const vector<vector<Pixel>>& image) {
-    int width = image[0].size();
-    int height = image.size();
-    
-    // Create a buffer for the output image
-    unsigned char* buffer = new unsigned char[width * height * 3];
+static int treeLevels(int size) {
+    int levels = 1;
+    for (int s = size; s > 1; s /= 2) {
+        levels++;
+    }
+    return levels;
+}
+
+// The tree build() produces, built from the smallest blocks upwards
+void QuadTree::buildBottomUp(const Image& image, int size, double threshold, int minBlockSize, int method) {
+    clear();
+    if (arenas.empty()) {
+        arenas.emplace_back();
+    }
+
+    BottomUpBuild build = {&image, 0, 0, image.width(), image.height(), nullptr, 0, threshold, minBlockSize, method,
+                           arenas[0], vector<array<BlockSummary, 4>>(treeLevels(size)), false};
+    BlockSummary rootSummary;
+    root = ::buildBottomUp(build, 0, 0, size, 0, rootSummary);
+    // Subtrees are dropped again as their parents collapse, so the final
+    // shape is only known at the end
+    stats = computeTreeStats(root);
+    traceCount(TRACE_NODES_CREATED, stats.nodes);
+}
+
+// Blocks above the tile size only ever hold merged summaries, so the tiles
+// can be read one at a time (in Z order) and the tree is still exactly the
+// one build() gives for the whole image
+bool QuadTree::buildTiled(PpmReader& reader, int size, int tileSize, double threshold, int minBlockSize, int method) {
+    clear();
+    if (arenas.empty()) {
+        arenas.emplace_back();
+    }
+
+    BottomUpBuild build = {nullptr, 0, 0, reader.width(), reader.height(), &reader, tileSize, threshold, minBlockSize, method,
+                           arenas[0], vector<array<BlockSummary, 4>>(treeLevels(size)), false};
+    BlockSummary rootSummary;
+    root = ::buildBottomUp(build, 0, 0, size, 0, rootSummary);
+    stats = computeTreeStats(root);
+    traceCount(TRACE_NODES_CREATED, stats.nodes);
+    return !build.failed;
+}
+
+// Discard all nodes at once, the arenas keep their blocks
+void QuadTree::clear() {
+    for (NodeArena& arena : arenas) {
+        arena.reset();
+    }
+    root = nullptr;
+    stats = TreeStats();
+}
+
+// Paint the leaves of a subtree that overlap rows [yBegin, yEnd), a whole
+// row span of a leaf at a time. Nodes depthLeft levels down are painted as
+// leaves.
+static void paintLeaves(const QuadTreeNode* node, Image& outputImage, int yBegin, int yEnd, int depthLeft) {
+    if (!node || node->y >= yEnd || node->y + node->size <= yBegin) return;
+
+    if (node->isLeaf || depthLeft == 0) {
+        const int xEnd = min(node->x + node->size, outputImage.width());
+        const int y0 = max(node->y, yBegin);
+        const int y1 = min(node->y + node->size, yEnd);
+        outputImage.fill(node->x, y0, xEnd - node->x, y1 - y0, node->avgColor);
+        return;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        paintLeaves(node->children[i], outputImage, yBegin, yEnd, depthLeft - 1);
+    }
+}
+
+// Reconstruct the image from the QuadTree
+void reconstructImage(const QuadTreeNode* node, Image& outputImage) {
+    paintLeaves(node, outputImage, 0, outputImage.height(), INT_MAX);
+}
+
+// Every internal node holds its block's average color, so cutting the tree
+// at maxDepth gives a coarser image at no extra cost
+void reconstructImage(const QuadTreeNode* root, Image& outputImage, int maxDepth) {
+    paintLeaves(root, outputImage, 0, outputImage.height(), max(0, maxDepth));
+}
+
+// Bands shorter than this are not worth a task
+static const int MIN_BAND_ROWS = 64;
+
+// Same image, painted as horizontal bands in parallel. Bands share no rows,
+// and each task only descends into the subtrees that overlap its band.
+void reconstructImage(const QuadTreeNode* root, Image& outputImage, ThreadPool& pool, int maxDepth) {
+    const int height = outputImage.height();
+    const int depthLeft = max(0, maxDepth);
+    int bands = min(pool.size() * 4, max(1, height / MIN_BAND_ROWS));
+    if (bands <= 1) {
+        paintLeaves(root, outputImage, 0, height, depthLeft);
+        return;
+    }
+
+    TaskGroup group(pool);
+    for (int band = 0; band < bands; band++) {
+        int yBegin = (int)((long long)height * band / bands);
+        int yEnd = (int)((long long)height * (band + 1) / bands);
+        group.run([root, &outputImage, yBegin, yEnd, depthLeft]() {
+            TraceScope scope("paint band");
+            paintLeaves(root, outputImage, yBegin, yEnd, depthLeft);
+        });
+    }
+    group.wait();
+}
+
+static void appendBytes(void* context, void* data, int size) {
+    vector<unsigned char>& out = *static_cast<vector<unsigned char>*>(context);
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    out.insert(out.end(), bytes, bytes + size);
+}
+
+// Encode an image as png, jpg/jpeg or bmp into memory
+bool encodeImage(const Image& image, const string& format, vector<unsigned char>& out) {
+    int width = image.width();
+    int height = image.height();
     
-    // Copy the pixel data to the buffer
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            int idx = (y * width + x) * 3;
-            buffer[idx] = image[y][x].r;
-            buffer[idx + 1] = image[y][x].g;
-            buffer[idx + 2] = image[y][x].b;
+    // stb_image_write wants tightly packed rows for JPG/BMP; only repack padded images
+    const unsigned char* buffer = image.data();
+    unsigned char* packed = nullptr;
+    if (!image.isPacked()) {
+        packed = new unsigned char[(size_t)width * height * 3];
+        for (int y = 0; y < height; y++) {
+            memcpy(packed + (size_t)y * width * 3, image.row(y), (size_t)width * 3);
         }
+        buffer = packed;
     }
     
-    // Determine the file format based on the extension
-    string extension = filename.substr(filename.find_last_of(".") + 1);
+    string extension = format;
     transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
     
+    TraceScope scope("stbi_write", extension);
+    out.clear();
     bool success = false;
     if (extension == "png") {
-        success = stbi_write_png(filename.c_str(), width, height, 3, buffer, width * 3);
+        success = stbi_write_png_to_func(appendBytes, &out, width, height, 3, buffer, width * 3);
     } else if (extension == "jpg" || extension == "jpeg") {
-        success = stbi_write_jpg(filename.c_str(), width, height, 3, buffer, 90); // Quality 90
+        success = stbi_write_jpg_to_func(appendBytes, &out, width, height, 3, buffer, 90); // Quality 90
     } else if (extension == "bmp") {
-        success = stbi_write_bmp(filename.c_str(), width, height, 3, buffer);
+        success = stbi_write_bmp_to_func(appendBytes, &out, width, height, 3, buffer);
     } else {
         cerr << "Unsupported output format: " << extension << endl;
     }
     
-    delete[] buffer;
+    delete[] packed;
     return success;
 }
 
+// Save the reconstructed image to a file
+bool saveQuadTreeImage(const string& filename, const Image& image) {
+    // Determine the file format based on the extension
+    vector<unsigned char> encoded;
+    if (!encodeImage(image, filename.substr(filename.find_last_of(".") + 1), encoded)) {
+        return false;
+    }
+
+    ofstream file(filename, ios::binary);
+    file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+    if (!file) {
+        return false;
+    }
+    traceCount(TRACE_BYTES_WRITTEN, encoded.size());
+    return true;
+}
+
+void TreeStats::merge(const TreeStats& other) {
+    nodes += other.nodes;
+    leaves += other.leaves;
+    depth = max(depth, other.depth);
+    for (int i = 0; i < MAX_DEPTH; i++) {
+        nodesPerDepth[i] += other.nodesPerDepth[i];
+        leavesPerDepth[i] += other.leavesPerDepth[i];
+    }
+}
+
+static void addTreeStats(const QuadTreeNode* node, int depth, TreeStats& stats) {
+    stats.add(depth, node->isLeaf);
+    if (!node->isLeaf) {
+        for (int i = 0; i < 4; i++) {
+            if (node->children[i]) {
+                addTreeStats(node->children[i], depth + 1, stats);
+            }
+        }
+    }
+}
+
+TreeStats computeTreeStats(const QuadTreeNode* root) {
+    TreeStats stats;
+    if (root) {
+        addTreeStats(root, 0, stats);
+    }
+    return stats;
+}
+
 // Count the number of nodes in the QuadTree
 int countNodes(const QuadTreeNode* node) {
     if (!node) return 0;
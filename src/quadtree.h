@@ -4,14 +4,15 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include "image.h"
+#include "arena.h"
+#include "threadpool.h"
 
 using namespace std;
 
-// Structure to store RGB values of a pixel
-struct Pixel {
-    unsigned char r, g, b;
-};
-
 // Structure to store statistics of a block
 struct BlockStats {
     double meanR, meanG, meanB;
@@ -21,6 +22,59 @@ struct BlockStats {
     double entropyR, entropyG, entropyB;
 };
 
+// Per-channel min and max of every aligned power-of-two block, i.e. of every
+// block a quadtree rooted at (0, 0) can contain. levels[k] is the grid of
+// blocks of side 2^k, ceil(width / 2^k) x ceil(height / 2^k), each clipped
+// to the image. Level 0 stays empty: a single pixel's range is always 0.
+struct MinMaxPyramid {
+    struct Range { unsigned char minValue[3], maxValue[3]; };
+    struct Level {
+        int width = 0, height = 0;
+        vector<Range> ranges;
+    };
+
+    int width = 0, height = 0;
+    vector<Level> levels;
+
+    size_t bytes() const; // Memory held by all levels
+};
+
+// Summed-area tables for O(1) block queries. Entry (x, y) holds the total of
+// all pixels in [0, x) x [0, y), so the tables are (width + 1) x (height + 1).
+// Channel sums are stored modulo 2^32 and are only read back through
+// rectangles small enough not to wrap (see quadtree.cpp).
+struct IntegralImage {
+    struct Sum { uint32_t r, g, b; };
+    struct SumSq { uint64_t r, g, b; };
+
+    int width = 0, height = 0;
+    vector<Sum> sum;
+    vector<SumSq> sumSq; // Only filled when built with squares (Variance)
+    MinMaxPyramid ranges; // Only filled when built with ranges (Max Pixel Difference)
+};
+
+// Sufficient statistics of a block: everything the four error methods need,
+// in a form where a block's summary is the merge() of its quadrants'. merge()
+// is associative and commutative, so summaries combine in any grouping
+// (bottom-up, incremental, per-thread partial results). `parts` says which
+// fields are kept; summaries that are merged must keep the same parts.
+struct BlockSummary {
+    enum Part { SUMS = 1, SQUARES = 2, RANGE = 4, HISTOGRAM = 8, ALL = 15 };
+    struct Bin { unsigned char value; uint32_t count; };
+
+    int parts = ALL;
+    long long count = 0;
+    uint64_t sums[3] = {0, 0, 0};
+    uint64_t sumSq[3] = {0, 0, 0};
+    unsigned char minValue[3] = {255, 255, 255};
+    unsigned char maxValue[3] = {0, 0, 0};
+    vector<Bin> hist[3]; // Values that occur, ascending
+
+    void clear(int keep = ALL);
+    void merge(const BlockSummary& other);
+    static int partsFor(int method); // What the method's error is computed from
+};
+
 // QuadTree node structure
 class QuadTreeNode {
 public:
@@ -30,20 +84,95 @@ public:
     QuadTreeNode* children[4]; // NW, NE, SW, SE
 
     QuadTreeNode(int x, int y, int size);
-    ~QuadTreeNode();
+};
+
+// Shape of a tree, recorded while it is built so reporting needs no
+// traversal. Depth 0 is the root; depth counts levels like getTreeDepth.
+struct TreeStats {
+    static const int MAX_DEPTH = 32; // Root sizes up to 2^31
+
+    size_t nodes = 0;
+    size_t leaves = 0;
+    int depth = 0;
+    size_t nodesPerDepth[MAX_DEPTH] = {};
+    size_t leavesPerDepth[MAX_DEPTH] = {};
+
+    void add(int nodeDepth, bool leaf) {
+        nodes++;
+        leaves += leaf;
+        depth = max(depth, nodeDepth + 1);
+        nodesPerDepth[nodeDepth]++;
+        leavesPerDepth[nodeDepth] += leaf;
+    }
+    void merge(const TreeStats& other);
+};
+
+// Same numbers for a tree built elsewhere, by one traversal
+TreeStats computeTreeStats(const QuadTreeNode* root);
+
+// Nodes are allocated from an arena owned by the tree, never with new/delete
+typedef Arena<QuadTreeNode> NodeArena;
+
+// A quadtree together with the arenas its nodes live in (one per pool
+// thread, so parallel builds never contend on allocation). clear()
+// discards every node in O(1) and keeps the memory for the next build.
+class QuadTree {
+public:
+    QuadTreeNode* root = nullptr;
+    vector<NodeArena> arenas;
+    TreeStats stats; // Kept up to date by every build
+
+    // With a pool of more than one thread the quadrants of large blocks are
+    // built in parallel; the resulting tree is identical to the serial one.
+    void build(const Image& image, int size, double threshold, int minBlockSize, int method, const IntegralImage* integral = nullptr, ThreadPool* pool = nullptr);
+    // Alternative build from the smallest blocks upwards: their summaries
+    // are merged four at a time instead of rescanning every block, so each
+    // pixel is read once. Serial; gives the same tree as build().
+    void buildBottomUp(const Image& image, int size, double threshold, int minBlockSize, int method);
+    // Same tree as buildBottomUp for an image too large to hold: only one
+    // tile of tileSize x tileSize pixels (a power of two) is resident at a
+    // time. False if a tile could not be read.
+    bool buildTiled(PpmReader& reader, int size, int tileSize, double threshold, int minBlockSize, int method);
+    void clear();
 };
 
 // Function declarations
-double calculateVariance(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor);
-double calculateMAD(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor);
-double calculateMaxDifference(vector<vector<Pixel>>& data, int x, int y, int size);
-double calculateEntropy(vector<vector<Pixel>>& data, int x, int y, int size) ;
-BlockStats calculateBlockStats(const vector<vector<Pixel>>& data, int x, int y, int size);
-Pixel calculateAvgColor(const vector<vector<Pixel>>& data, int x, int y, int size);
-double calculateError(vector<vector<Pixel>>& data, int x, int y, int size, Pixel avgColor, int method);
-QuadTreeNode* buildQuadTree(const vector<vector<Pixel>>& data, int x, int y, int size, double threshold, int minBlockSize, int method, int depth = 0);
-void reconstructImage(const QuadTreeNode* node, vector<vector<Pixel>>& outputImage);
-bool saveQuadTreeImage(const string& filename, const vector<vector<Pixel>>& image);
+double calculateVariance(const Image& image, int x, int y, int size, Pixel avgColor);
+double calculateMAD(const Image& image, int x, int y, int size, Pixel avgColor);
+double calculateMaxDifference(const Image& image, int x, int y, int size);
+double calculateEntropy(const Image& image, int x, int y, int size) ;
+BlockStats calculateBlockStats(const Image& image, int x, int y, int size);
+Pixel calculateAvgColor(const Image& image, int x, int y, int size);
+double calculateError(const Image& image, int x, int y, int size, Pixel avgColor, int method, const IntegralImage* integral = nullptr);
+// Average color plus the method's error in a single scan (two for MAD)
+double calculateAvgColorAndError(const Image& image, int x, int y, int size, int method, Pixel& avgColor);
+// What buildQuadTree evaluates per block: summed-area tables where they apply, the fused kernel otherwise
+double calculateBlockError(const Image& image, int x, int y, int size, int method, const IntegralImage* integral, Pixel& avgColor);
+// Fill summary.parts of a block's summary from its pixels
+void calculateBlockSummary(const Image& image, int x, int y, int size, BlockSummary& summary);
+Pixel calculateAvgColor(const BlockSummary& summary);
+double calculateVariance(const BlockSummary& summary, Pixel avgColor);
+double calculateMAD(const BlockSummary& summary, Pixel avgColor);
+double calculateMaxDifference(const BlockSummary& summary);
+double calculateEntropy(const BlockSummary& summary);
+double calculateError(const BlockSummary& summary, Pixel avgColor, int method);
+IntegralImage buildIntegralImage(const Image& image, bool withSquares, bool withRanges = false);
+// Entropy needs each block's histogram, which no summed-area table gives,
+// so its blocks always go through the fused pixel kernel
+inline bool usesIntegralImage(int method) { return method != 4; }
+MinMaxPyramid buildMinMaxPyramid(const Image& image);
+// O(1) for an aligned block of power-of-two size (any block of the quadtree)
+double calculateMaxDifference(const MinMaxPyramid& pyramid, int x, int y, int size);
+Pixel calculateAvgColor(const IntegralImage& integral, int x, int y, int size);
+double calculateVariance(const IntegralImage& integral, int x, int y, int size, Pixel avgColor);
+QuadTreeNode* buildQuadTree(const Image& image, NodeArena& arena, int x, int y, int size, double threshold, int minBlockSize, int method, const IntegralImage* integral = nullptr, int depth = 0, TreeStats* stats = nullptr);
+void reconstructImage(const QuadTreeNode* node, Image& outputImage);
+// Low-detail preview: nodes at maxDepth (0 = the root) are painted as leaves
+void reconstructImage(const QuadTreeNode* root, Image& outputImage, int maxDepth);
+void reconstructImage(const QuadTreeNode* root, Image& outputImage, ThreadPool& pool, int maxDepth = INT_MAX);
+bool saveQuadTreeImage(const string& filename, const Image& image);
+// The same bytes in memory; format is the extension (png, jpg, jpeg, bmp)
+bool encodeImage(const Image& image, const string& format, vector<unsigned char>& out);
 int countNodes(const QuadTreeNode* node);
 int getTreeDepth(const QuadTreeNode* node);
 //bool generateGif(const string& filename, const QuadTreeNode* root, int width, int height);
@@ -0,0 +1,132 @@
+#ifndef RANGECODER_H
+#define RANGECODER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Adaptive binary range coder (the LZMA construction). Every coded bit has
+// a BitModel holding the running probability of a 0; models adapt as bits
+// go through them, so skewed flags and small deltas cost well under a bit.
+
+static const int RC_PROB_BITS = 11;
+static const int RC_MOVE_BITS = 5;
+static const uint32_t RC_TOP = 1u << 24;
+
+struct BitModel {
+    uint16_t prob = 1 << (RC_PROB_BITS - 1); // P(bit == 0), scaled to 2^11
+};
+
+class RangeEncoder {
+public:
+    explicit RangeEncoder(vector<unsigned char>& out) : out_(out) {}
+
+    void encodeBit(BitModel& model, int bit) {
+        uint32_t bound = (range_ >> RC_PROB_BITS) * model.prob;
+        if (bit == 0) {
+            range_ = bound;
+            model.prob += ((1 << RC_PROB_BITS) - model.prob) >> RC_MOVE_BITS;
+        } else {
+            low_ += bound;
+            range_ -= bound;
+            model.prob -= model.prob >> RC_MOVE_BITS;
+        }
+        while (range_ < RC_TOP) {
+            range_ <<= 8;
+            shiftLow();
+        }
+    }
+
+    // Code the low `bits` bits of value MSB first through a binary tree of models (size 2^bits)
+    void encodeTree(BitModel* models, int bits, uint32_t value) {
+        uint32_t m = 1;
+        for (int i = bits - 1; i >= 0; i--) {
+            int bit = (value >> i) & 1;
+            encodeBit(models[m], bit);
+            m = (m << 1) | bit;
+        }
+    }
+
+    void flush() {
+        for (int i = 0; i < 5; i++) {
+            shiftLow();
+        }
+    }
+
+private:
+    // Emit the top byte of low, resolving carries through the run of pending 0xFF bytes
+    void shiftLow() {
+        if ((uint32_t)low_ < 0xFF000000u || (low_ >> 32) != 0) {
+            unsigned char carry = (unsigned char)(low_ >> 32);
+            unsigned char temp = cache_;
+            do {
+                out_.push_back((unsigned char)(temp + carry));
+                temp = 0xFF;
+            } while (--cacheSize_ != 0);
+            cache_ = (unsigned char)(low_ >> 24);
+        }
+        cacheSize_++;
+        low_ = (low_ & 0x00FFFFFFu) << 8;
+    }
+
+    vector<unsigned char>& out_;
+    uint64_t low_ = 0;
+    uint32_t range_ = 0xFFFFFFFFu;
+    unsigned char cache_ = 0;
+    uint64_t cacheSize_ = 1;
+};
+
+class RangeDecoder {
+public:
+    RangeDecoder(const unsigned char* data, size_t size) : data_(data), size_(size) {
+        for (int i = 0; i < 5; i++) {
+            code_ = (code_ << 8) | nextByte();
+        }
+    }
+
+    int decodeBit(BitModel& model) {
+        uint32_t bound = (range_ >> RC_PROB_BITS) * model.prob;
+        int bit;
+        if (code_ < bound) {
+            range_ = bound;
+            model.prob += ((1 << RC_PROB_BITS) - model.prob) >> RC_MOVE_BITS;
+            bit = 0;
+        } else {
+            code_ -= bound;
+            range_ -= bound;
+            model.prob -= model.prob >> RC_MOVE_BITS;
+            bit = 1;
+        }
+        while (range_ < RC_TOP) {
+            range_ <<= 8;
+            code_ = (code_ << 8) | nextByte();
+        }
+        return bit;
+    }
+
+    uint32_t decodeTree(BitModel* models, int bits) {
+        uint32_t m = 1;
+        for (int i = 0; i < bits; i++) {
+            m = (m << 1) | decodeBit(models[m]);
+        }
+        return m - (1u << bits);
+    }
+
+    // True once the decoder needed bytes past the end of its input
+    bool overrun() const { return pos_ > size_; }
+
+private:
+    unsigned char nextByte() {
+        return pos_ < size_ ? data_[pos_++] : (pos_++, 0);
+    }
+
+    const unsigned char* data_;
+    size_t size_;
+    size_t pos_ = 0;
+    uint32_t code_ = 0;
+    uint32_t range_ = 0xFFFFFFFFu;
+};
+
+#endif // RANGECODER_H
@@ -0,0 +1,71 @@
+#include "scheduler.h"
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+using namespace std;
+
+// Memory and job slots of the jobs in flight
+struct Admission {
+    mutex lock;
+    condition_variable released;
+    ScheduleLimits limits;
+    size_t used = 0;
+    int inFlight = 0;
+    unsigned long generation = 0; // Bumped by every release, so a waiter cannot miss one
+    ScheduleReport report;
+
+    bool tryAcquire(size_t bytes, unsigned long& seen) {
+        lock_guard<mutex> guard(lock);
+        seen = generation;
+        bool fits = limits.memoryBudget == 0 || used == 0 || used + bytes <= limits.memoryBudget;
+        if (!fits || inFlight >= limits.maxInFlight) {
+            return false;
+        }
+        used += bytes;
+        inFlight++;
+        report.peakMemory = max(report.peakMemory, used);
+        report.peakInFlight = max(report.peakInFlight, inFlight);
+        return true;
+    }
+
+    void release(size_t bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            used -= bytes;
+            inFlight--;
+            generation++;
+        }
+        released.notify_all();
+    }
+
+    void waitForRelease(unsigned long seen) {
+        unique_lock<mutex> guard(lock);
+        released.wait(guard, [&]() { return generation != seen; });
+    }
+};
+
+ScheduleReport runScheduled(ThreadPool& pool, const vector<size_t>& jobBytes, ScheduleLimits limits, function<void(size_t)> run) {
+    Admission admission;
+    admission.limits = limits;
+    admission.limits.maxInFlight = max(1, limits.maxInFlight);
+
+    TaskGroup group(pool);
+    for (size_t i = 0; i < jobBytes.size(); i++) {
+        const size_t bytes = jobBytes[i];
+        unsigned long seen;
+        while (!admission.tryAcquire(bytes, seen)) {
+            // Only jobs already in flight can free room. Help run them (this
+            // thread may be the only one) and sleep when there is nothing to run.
+            if (!pool.runPending()) {
+                admission.waitForRelease(seen);
+            }
+        }
+        group.run([&admission, &run, i, bytes]() {
+            run(i);
+            admission.release(bytes);
+        });
+    }
+    group.wait();
+    return admission.report;
+}
@@ -0,0 +1,35 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include "threadpool.h"
+
+using namespace std;
+
+// Runs many independent jobs (one image each) on a shared pool. Every job
+// is a single pool task that goes through all of its stages; jobs in
+// different stages overlap, so while one image waits on the disk the
+// others keep the workers busy, and the stages that fork (build,
+// reconstruct) spread over the same workers.
+//
+// A job is only admitted once its estimated memory fits in the budget next
+// to the jobs already in flight, and at most maxInFlight jobs are admitted
+// at a time. A job larger than the whole budget runs on its own. Jobs are
+// admitted in order.
+struct ScheduleLimits {
+    size_t memoryBudget; // Bytes, 0 for no limit
+    int maxInFlight;
+};
+
+struct ScheduleReport {
+    size_t peakMemory = 0; // Highest sum of the estimates of the jobs in flight
+    int peakInFlight = 0;
+};
+
+// Calls run(i) for every job, with jobBytes[i] its memory estimate.
+// Returns once all jobs have finished.
+ScheduleReport runScheduled(ThreadPool& pool, const vector<size_t>& jobBytes, ScheduleLimits limits, function<void(size_t)> run);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,217 @@
+#include "server.h"
+#include "protocol.h"
+#include <iostream>
+#include <cstring>
+#include <csignal>
+
+#ifdef HAVE_UNIX_SOCKETS
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <ctime>
+#include <vector>
+#include <new>
+#include <stdexcept>
+#endif
+
+using namespace std;
+
+#ifdef HAVE_UNIX_SOCKETS
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+static bool socketAddress(const string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: socket path too long: " << path << endl;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// A socket file left behind by a server that died is removed; one that
+// still accepts connections belongs to a live server and is kept
+static bool claimSocketPath(const string& path, const sockaddr_un& address) {
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0) return true;
+    if (!S_ISSOCK(info.st_mode)) {
+        cerr << "Error: " << path << " exists and is not a socket" << endl;
+        return false;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = probe >= 0 && connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    if (probe >= 0) close(probe);
+    if (live) {
+        cerr << "Error: a server is already listening on " << path << endl;
+        return false;
+    }
+    unlink(path.c_str());
+    return true;
+}
+
+// Limits that keep one client from holding the server: a message must be
+// read or written whole within IO_TIMEOUT_SECONDS, however slowly its bytes
+// trickle, idle connections are closed, and a connection is closed after
+// so many requests (the client reconnects)
+static const int MAX_CONNECTIONS = 64;
+static const int IO_TIMEOUT_SECONDS = 10;
+static const int IO_TIMEOUT_MS = IO_TIMEOUT_SECONDS * 1000;
+static const int IDLE_TIMEOUT_SECONDS = 60;
+static const int MAX_REQUESTS_PER_CONNECTION = 1000;
+
+struct Connection {
+    int fd;
+    int requests;
+    time_t lastActive;
+};
+
+// A reply to an exception: the request failed, the server keeps running
+static void failRequest(Message& reply, const string& message) {
+    reply = Message();
+    reply.command = "ERROR";
+    reply.add("message", message);
+}
+
+// One request of a connection whose socket is readable. Returns false when
+// the connection is done; shutdown is set by a SHUTDOWN request.
+static bool serveRequest(Connection& connection, RequestHandler& handler, bool& shutdown) {
+    Message request;
+    if (!readMessage(connection.fd, request, MAX_REQUEST_PAYLOAD_BYTES, IO_TIMEOUT_MS)) return false;
+    connection.requests++;
+    connection.lastActive = time(nullptr);
+
+    Message reply;
+    reply.command = "OK";
+    if (request.command == "SHUTDOWN") {
+        writeMessage(connection.fd, reply, IO_TIMEOUT_MS);
+        shutdown = true;
+        return false;
+    }
+    if (request.command == "PING") {
+        // Nothing to do, the reply shows the server is up
+    } else if (request.command == "COMPRESS") {
+        try {
+            handler(request, reply);
+        } catch (const bad_alloc&) {
+            failRequest(reply, "out of memory");
+        } catch (const exception& error) {
+            failRequest(reply, error.what());
+        }
+    } else {
+        reply.command = "ERROR";
+        reply.add("message", "unknown command " + request.command);
+    }
+    return writeMessage(connection.fd, reply, IO_TIMEOUT_MS) && connection.requests < MAX_REQUESTS_PER_CONNECTION;
+}
+
+static void acceptConnection(int listener, vector<Connection>& connections) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            cerr << "Error: accept failed: " << strerror(errno) << endl;
+        }
+        return;
+    }
+    if ((int)connections.size() >= MAX_CONNECTIONS) {
+        Message reply;
+        reply.command = "ERROR";
+        reply.add("message", "too many connections");
+        writeMessage(fd, reply, IO_TIMEOUT_MS);
+        close(fd);
+        return;
+    }
+
+    connections.push_back(Connection{fd, 0, time(nullptr)});
+}
+
+int runServer(const string& socketPath, RequestHandler handler) {
+    sockaddr_un address;
+    if (!socketAddress(socketPath, address) || !claimSocketPath(socketPath, address)) {
+        return 1;
+    }
+
+    // The socket is created owner-only: whoever can connect can make the
+    // server read images with its permissions
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t previousMask = umask(0177);
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0;
+    umask(previousMask);
+    if (!bound || listen(listener, 16) != 0) {
+        cerr << "Error: Could not listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+
+    // No SA_RESTART, so a signal interrupts poll() and the loop can exit
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Requests are still answered one at a time, but only connections
+    // with data waiting are read, so an idle client blocks no one
+    cout << "Listening on " << socketPath << endl;
+    vector<Connection> connections;
+    vector<pollfd> waiting;
+    bool shutdown = false;
+    while (!shutdown && !stopRequested) {
+        waiting.assign(1, pollfd{listener, POLLIN, 0});
+        for (const Connection& connection : connections) {
+            waiting.push_back(pollfd{connection.fd, POLLIN, 0});
+        }
+        int ready = poll(waiting.data(), waiting.size(), 1000);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error: poll failed: " << strerror(errno) << endl;
+            break;
+        }
+
+        const time_t now = time(nullptr);
+        vector<Connection> open;
+        for (size_t i = 0; i < connections.size(); i++) {
+            Connection& connection = connections[i];
+            bool keep;
+            if (waiting[i + 1].revents != 0) {
+                keep = !shutdown && serveRequest(connection, handler, shutdown);
+            } else {
+                keep = now - connection.lastActive < IDLE_TIMEOUT_SECONDS;
+            }
+            if (keep) {
+                open.push_back(connection);
+            } else {
+                close(connection.fd);
+            }
+        }
+        connections.swap(open);
+        if (waiting[0].revents & POLLIN) {
+            acceptConnection(listener, connections);
+        }
+    }
+
+    for (const Connection& connection : connections) {
+        close(connection.fd);
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    cout << "Server stopped" << endl;
+    return 0;
+}
+
+#else
+
+int runServer(const string& socketPath, RequestHandler handler) {
+    cerr << "Error: --serve needs Unix domain sockets, which this platform does not have" << endl;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <functional>
+
+using namespace std;
+
+struct Message;
+
+// Answers one request. reply starts out as an empty OK message.
+typedef function<void(const Message& request, Message& reply)> RequestHandler;
+
+// Listen on a Unix domain socket at socketPath (created owner-only) and
+// answer every request with handler, one at a time in the calling thread
+// (each request already spreads over the thread pool), until a SHUTDOWN
+// request, SIGINT or SIGTERM. Several clients may be connected and send
+// any number of requests each; a request that throws gets an ERROR reply.
+// Returns the process exit status.
+int runServer(const string& socketPath, RequestHandler handler);
+
+#endif // SERVER_H
@@ -0,0 +1,371 @@
+#include "simd.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PIXEL_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const PixelKernels SCALAR_KERNELS = {"scalar", sumScalar, sumSquaresScalar, minMaxScalar, absDiffScalar};
+
+#ifdef PIXEL_KERNELS_X86
+
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// Squares are summed in 32-bit lanes: each lane gains at most 4 * 255^2 per
+// step, so the lanes are flushed to 64 bits well before they could overflow
+static const int SQUARE_FLUSH = 4096;
+
+// Split 16 interleaved pixels (48 bytes) into one vector per channel
+TARGET_SSE41 static inline void deinterleave16(const Pixel* p, __m128i& r, __m128i& g, __m128i& b) {
+    const __m128i* src = reinterpret_cast<const __m128i*>(p);
+    __m128i a = _mm_loadu_si128(src);
+    __m128i c = _mm_loadu_si128(src + 1);
+    __m128i d = _mm_loadu_si128(src + 2);
+
+    r = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(d, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+    g = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(d, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+    b = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+            _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+            _mm_shuffle_epi8(d, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+// Horizontal reductions, run once per block
+TARGET_SSE41 static inline uint64_t total64(__m128i v) {
+    return (uint64_t)_mm_cvtsi128_si64(v) + (uint64_t)_mm_extract_epi64(v, 1);
+}
+
+TARGET_SSE41 static inline uint64_t total32(__m128i v) {
+    __m128i zero = _mm_setzero_si128();
+    return total64(_mm_add_epi64(_mm_unpacklo_epi32(v, zero), _mm_unpackhi_epi32(v, zero)));
+}
+
+TARGET_SSE41 static inline unsigned char minByte(__m128i v) {
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_min_epu8(v, _mm_srli_si128(v, 1));
+    return (unsigned char)_mm_cvtsi128_si32(v);
+}
+
+TARGET_SSE41 static inline unsigned char maxByte(__m128i v) {
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 4));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 2));
+    v = _mm_max_epu8(v, _mm_srli_si128(v, 1));
+    return (unsigned char)_mm_cvtsi128_si32(v);
+}
+
+// Sum of squares of 16 bytes as four 32-bit lanes
+TARGET_SSE41 static inline __m128i squares16(__m128i v) {
+    __m128i lo = _mm_cvtepu8_epi16(v);
+    __m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(v, 8));
+    return _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+}
+
+// SSE4.1: 16 pixels per step. psadbw against zero gives the byte sums,
+// psadbw against the center gives the absolute deviations directly.
+
+TARGET_SSE41 static void sumSse41(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3]) {
+    if (width < VECTOR_MIN_PIXELS) {
+        sumScalar(p, stride, width, rows, sum);
+        return;
+    }
+    const int vectorWidth = width & ~15;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sr = zero, sg = zero, sb = zero;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i r, g, b;
+            deinterleave16(p + i, r, g, b);
+            sr = _mm_add_epi64(sr, _mm_sad_epu8(r, zero));
+            sg = _mm_add_epi64(sg, _mm_sad_epu8(g, zero));
+            sb = _mm_add_epi64(sb, _mm_sad_epu8(b, zero));
+        }
+        sumScalar(p + vectorWidth, stride, width - vectorWidth, 1, sum);
+    }
+    sum[0] += total64(sr);
+    sum[1] += total64(sg);
+    sum[2] += total64(sb);
+}
+
+TARGET_SSE41 static void sumSquaresSse41(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3], uint64_t sumSq[3]) {
+    if (width < VECTOR_MIN_PIXELS) {
+        sumSquaresScalar(p, stride, width, rows, sum, sumSq);
+        return;
+    }
+    const int vectorWidth = width & ~15;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sr = zero, sg = zero, sb = zero;
+    __m128i qr = zero, qg = zero, qb = zero;
+    int pending = 0;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i r, g, b;
+            deinterleave16(p + i, r, g, b);
+            sr = _mm_add_epi64(sr, _mm_sad_epu8(r, zero));
+            sg = _mm_add_epi64(sg, _mm_sad_epu8(g, zero));
+            sb = _mm_add_epi64(sb, _mm_sad_epu8(b, zero));
+            qr = _mm_add_epi32(qr, squares16(r));
+            qg = _mm_add_epi32(qg, squares16(g));
+            qb = _mm_add_epi32(qb, squares16(b));
+            if (++pending == SQUARE_FLUSH) {
+                sumSq[0] += total32(qr);
+                sumSq[1] += total32(qg);
+                sumSq[2] += total32(qb);
+                qr = qg = qb = zero;
+                pending = 0;
+            }
+        }
+        sumSquaresScalar(p + vectorWidth, stride, width - vectorWidth, 1, sum, sumSq);
+    }
+    sum[0] += total64(sr);
+    sum[1] += total64(sg);
+    sum[2] += total64(sb);
+    sumSq[0] += total32(qr);
+    sumSq[1] += total32(qg);
+    sumSq[2] += total32(qb);
+}
+
+TARGET_SSE41 static void minMaxSse41(const Pixel* p, size_t stride, int width, int rows, unsigned char minValue[3], unsigned char maxValue[3]) {
+    if (width < VECTOR_MIN_PIXELS) {
+        minMaxScalar(p, stride, width, rows, minValue, maxValue);
+        return;
+    }
+    const int vectorWidth = width & ~15;
+    __m128i minR = _mm_set1_epi8((char)minValue[0]), maxR = _mm_set1_epi8((char)maxValue[0]);
+    __m128i minG = _mm_set1_epi8((char)minValue[1]), maxG = _mm_set1_epi8((char)maxValue[1]);
+    __m128i minB = _mm_set1_epi8((char)minValue[2]), maxB = _mm_set1_epi8((char)maxValue[2]);
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i r, g, b;
+            deinterleave16(p + i, r, g, b);
+            minR = _mm_min_epu8(minR, r); maxR = _mm_max_epu8(maxR, r);
+            minG = _mm_min_epu8(minG, g); maxG = _mm_max_epu8(maxG, g);
+            minB = _mm_min_epu8(minB, b); maxB = _mm_max_epu8(maxB, b);
+        }
+        minMaxScalar(p + vectorWidth, stride, width - vectorWidth, 1, minValue, maxValue);
+    }
+    minValue[0] = min(minValue[0], minByte(minR));
+    minValue[1] = min(minValue[1], minByte(minG));
+    minValue[2] = min(minValue[2], minByte(minB));
+    maxValue[0] = max(maxValue[0], maxByte(maxR));
+    maxValue[1] = max(maxValue[1], maxByte(maxG));
+    maxValue[2] = max(maxValue[2], maxByte(maxB));
+}
+
+TARGET_SSE41 static void absDiffSse41(const Pixel* p, size_t stride, int width, int rows, Pixel center, uint64_t sad[3]) {
+    if (width < VECTOR_MIN_PIXELS) {
+        absDiffScalar(p, stride, width, rows, center, sad);
+        return;
+    }
+    const int vectorWidth = width & ~15;
+    const __m128i cr = _mm_set1_epi8((char)center.r);
+    const __m128i cg = _mm_set1_epi8((char)center.g);
+    const __m128i cb = _mm_set1_epi8((char)center.b);
+    __m128i sr = _mm_setzero_si128(), sg = sr, sb = sr;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 16) {
+            __m128i r, g, b;
+            deinterleave16(p + i, r, g, b);
+            sr = _mm_add_epi64(sr, _mm_sad_epu8(r, cr));
+            sg = _mm_add_epi64(sg, _mm_sad_epu8(g, cg));
+            sb = _mm_add_epi64(sb, _mm_sad_epu8(b, cb));
+        }
+        absDiffScalar(p + vectorWidth, stride, width - vectorWidth, 1, center, sad);
+    }
+    sad[0] += total64(sr);
+    sad[1] += total64(sg);
+    sad[2] += total64(sb);
+}
+
+static const PixelKernels SSE41_KERNELS = {"sse4.1", sumSse41, sumSquaresSse41, minMaxSse41, absDiffSse41};
+
+// AVX2: 32 pixels per step. The byte shuffles stay 128-bit (pshufb does not
+// cross lanes), the two halves are joined and reduced in 256-bit registers.
+// Blocks narrower than 32 pixels go to the SSE4.1 kernels.
+
+TARGET_AVX2 static inline void deinterleave32(const Pixel* p, __m256i& r, __m256i& g, __m256i& b) {
+    __m128i r0, g0, b0, r1, g1, b1;
+    deinterleave16(p, r0, g0, b0);
+    deinterleave16(p + 16, r1, g1, b1);
+    r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+    g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+    b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+}
+
+TARGET_AVX2 static inline __m128i fold64(__m256i v) {
+    return _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+TARGET_AVX2 static inline __m128i fold32(__m256i v) {
+    return _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+TARGET_AVX2 static inline __m256i squares32(__m256i v) {
+    __m256i lo = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+    __m256i hi = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+    return _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi));
+}
+
+TARGET_AVX2 static void sumAvx2(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3]) {
+    if (width < 32) {
+        sumSse41(p, stride, width, rows, sum);
+        return;
+    }
+    const int vectorWidth = width & ~31;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sr = zero, sg = zero, sb = zero;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i r, g, b;
+            deinterleave32(p + i, r, g, b);
+            sr = _mm256_add_epi64(sr, _mm256_sad_epu8(r, zero));
+            sg = _mm256_add_epi64(sg, _mm256_sad_epu8(g, zero));
+            sb = _mm256_add_epi64(sb, _mm256_sad_epu8(b, zero));
+        }
+        sumScalar(p + vectorWidth, stride, width - vectorWidth, 1, sum);
+    }
+    sum[0] += total64(fold64(sr));
+    sum[1] += total64(fold64(sg));
+    sum[2] += total64(fold64(sb));
+}
+
+TARGET_AVX2 static void sumSquaresAvx2(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3], uint64_t sumSq[3]) {
+    if (width < 32) {
+        sumSquaresSse41(p, stride, width, rows, sum, sumSq);
+        return;
+    }
+    const int vectorWidth = width & ~31;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sr = zero, sg = zero, sb = zero;
+    __m256i qr = zero, qg = zero, qb = zero;
+    int pending = 0;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i r, g, b;
+            deinterleave32(p + i, r, g, b);
+            sr = _mm256_add_epi64(sr, _mm256_sad_epu8(r, zero));
+            sg = _mm256_add_epi64(sg, _mm256_sad_epu8(g, zero));
+            sb = _mm256_add_epi64(sb, _mm256_sad_epu8(b, zero));
+            qr = _mm256_add_epi32(qr, squares32(r));
+            qg = _mm256_add_epi32(qg, squares32(g));
+            qb = _mm256_add_epi32(qb, squares32(b));
+            if (++pending == SQUARE_FLUSH / 2) { // fold32 adds two lanes together
+                sumSq[0] += total32(fold32(qr));
+                sumSq[1] += total32(fold32(qg));
+                sumSq[2] += total32(fold32(qb));
+                qr = qg = qb = zero;
+                pending = 0;
+            }
+        }
+        sumSquaresScalar(p + vectorWidth, stride, width - vectorWidth, 1, sum, sumSq);
+    }
+    sum[0] += total64(fold64(sr));
+    sum[1] += total64(fold64(sg));
+    sum[2] += total64(fold64(sb));
+    sumSq[0] += total32(fold32(qr));
+    sumSq[1] += total32(fold32(qg));
+    sumSq[2] += total32(fold32(qb));
+}
+
+TARGET_AVX2 static void minMaxAvx2(const Pixel* p, size_t stride, int width, int rows, unsigned char minValue[3], unsigned char maxValue[3]) {
+    if (width < 32) {
+        minMaxSse41(p, stride, width, rows, minValue, maxValue);
+        return;
+    }
+    const int vectorWidth = width & ~31;
+    __m256i minR = _mm256_set1_epi8((char)minValue[0]), maxR = _mm256_set1_epi8((char)maxValue[0]);
+    __m256i minG = _mm256_set1_epi8((char)minValue[1]), maxG = _mm256_set1_epi8((char)maxValue[1]);
+    __m256i minB = _mm256_set1_epi8((char)minValue[2]), maxB = _mm256_set1_epi8((char)maxValue[2]);
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i r, g, b;
+            deinterleave32(p + i, r, g, b);
+            minR = _mm256_min_epu8(minR, r); maxR = _mm256_max_epu8(maxR, r);
+            minG = _mm256_min_epu8(minG, g); maxG = _mm256_max_epu8(maxG, g);
+            minB = _mm256_min_epu8(minB, b); maxB = _mm256_max_epu8(maxB, b);
+        }
+        minMaxScalar(p + vectorWidth, stride, width - vectorWidth, 1, minValue, maxValue);
+    }
+    minValue[0] = min(minValue[0], minByte(_mm_min_epu8(_mm256_castsi256_si128(minR), _mm256_extracti128_si256(minR, 1))));
+    minValue[1] = min(minValue[1], minByte(_mm_min_epu8(_mm256_castsi256_si128(minG), _mm256_extracti128_si256(minG, 1))));
+    minValue[2] = min(minValue[2], minByte(_mm_min_epu8(_mm256_castsi256_si128(minB), _mm256_extracti128_si256(minB, 1))));
+    maxValue[0] = max(maxValue[0], maxByte(_mm_max_epu8(_mm256_castsi256_si128(maxR), _mm256_extracti128_si256(maxR, 1))));
+    maxValue[1] = max(maxValue[1], maxByte(_mm_max_epu8(_mm256_castsi256_si128(maxG), _mm256_extracti128_si256(maxG, 1))));
+    maxValue[2] = max(maxValue[2], maxByte(_mm_max_epu8(_mm256_castsi256_si128(maxB), _mm256_extracti128_si256(maxB, 1))));
+}
+
+TARGET_AVX2 static void absDiffAvx2(const Pixel* p, size_t stride, int width, int rows, Pixel center, uint64_t sad[3]) {
+    if (width < 32) {
+        absDiffSse41(p, stride, width, rows, center, sad);
+        return;
+    }
+    const int vectorWidth = width & ~31;
+    const __m256i cr = _mm256_set1_epi8((char)center.r);
+    const __m256i cg = _mm256_set1_epi8((char)center.g);
+    const __m256i cb = _mm256_set1_epi8((char)center.b);
+    __m256i sr = _mm256_setzero_si256(), sg = sr, sb = sr;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < vectorWidth; i += 32) {
+            __m256i r, g, b;
+            deinterleave32(p + i, r, g, b);
+            sr = _mm256_add_epi64(sr, _mm256_sad_epu8(r, cr));
+            sg = _mm256_add_epi64(sg, _mm256_sad_epu8(g, cg));
+            sb = _mm256_add_epi64(sb, _mm256_sad_epu8(b, cb));
+        }
+        absDiffScalar(p + vectorWidth, stride, width - vectorWidth, 1, center, sad);
+    }
+    sad[0] += total64(fold64(sr));
+    sad[1] += total64(fold64(sg));
+    sad[2] += total64(fold64(sb));
+}
+
+static const PixelKernels AVX2_KERNELS = {"avx2", sumAvx2, sumSquaresAvx2, minMaxAvx2, absDiffAvx2};
+
+#endif // PIXEL_KERNELS_X86
+
+static const PixelKernels& detectPixelKernels() {
+#ifdef PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return AVX2_KERNELS;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return SSE41_KERNELS;
+    }
+#endif
+    return SCALAR_KERNELS;
+}
+
+const PixelKernels& pixelKernels() {
+    static const PixelKernels& kernels = detectPixelKernels();
+    return kernels;
+}
+
+const PixelKernels& scalarPixelKernels() {
+    return SCALAR_KERNELS;
+}
+
+vector<const PixelKernels*> supportedPixelKernels() {
+    vector<const PixelKernels*> kernels(1, &SCALAR_KERNELS);
+#ifdef PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+        kernels.push_back(&SSE41_KERNELS);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&AVX2_KERNELS);
+    }
+#endif
+    return kernels;
+}
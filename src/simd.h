@@ -0,0 +1,108 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include "image.h"
+
+using namespace std;
+
+// Per-channel reductions over a block of interleaved RGB pixels, the inner
+// loops of every block metric. A block is `rows` runs of `width` pixels
+// starting at p, `stride` bytes apart (Image::stride()). Each kernel adds
+// into the arrays it is given (min/max are folded in).
+//
+// All kernels work on integers only, so the SIMD versions return exactly
+// what the scalar ones do and the metrics built on them are unchanged
+// bit for bit; there is no floating point tolerance to account for.
+struct PixelKernels {
+    const char* name;
+    void (*sum)(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3]);
+    void (*sumSquares)(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3], uint64_t sumSq[3]);
+    void (*minMax)(const Pixel* p, size_t stride, int width, int rows, unsigned char minValue[3], unsigned char maxValue[3]);
+    void (*absDiff)(const Pixel* p, size_t stride, int width, int rows, Pixel center, uint64_t sad[3]); // Sum of |p - center|
+};
+
+// Row of a block, stride bytes after the previous one
+inline const Pixel* nextRow(const Pixel* p, size_t stride) {
+    return reinterpret_cast<const Pixel*>(reinterpret_cast<const unsigned char*>(p) + stride);
+}
+
+// Scalar kernels. The SIMD versions use them for blocks narrower than
+// VECTOR_MIN_PIXELS and for the ends of rows; being inline they also let
+// callers handle the many tiny blocks of a deep tree without an indirect call.
+static const int VECTOR_MIN_PIXELS = 16;
+
+inline void sumScalar(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3]) {
+    uint64_t r = 0, g = 0, b = 0;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < width; i++) {
+            r += p[i].r;
+            g += p[i].g;
+            b += p[i].b;
+        }
+    }
+    sum[0] += r;
+    sum[1] += g;
+    sum[2] += b;
+}
+
+inline void sumSquaresScalar(const Pixel* p, size_t stride, int width, int rows, uint64_t sum[3], uint64_t sumSq[3]) {
+    uint64_t r = 0, g = 0, b = 0, rr = 0, gg = 0, bb = 0;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < width; i++) {
+            r += p[i].r;
+            g += p[i].g;
+            b += p[i].b;
+            rr += p[i].r * p[i].r;
+            gg += p[i].g * p[i].g;
+            bb += p[i].b * p[i].b;
+        }
+    }
+    sum[0] += r;
+    sum[1] += g;
+    sum[2] += b;
+    sumSq[0] += rr;
+    sumSq[1] += gg;
+    sumSq[2] += bb;
+}
+
+inline void minMaxScalar(const Pixel* p, size_t stride, int width, int rows, unsigned char minValue[3], unsigned char maxValue[3]) {
+    unsigned char minR = minValue[0], minG = minValue[1], minB = minValue[2];
+    unsigned char maxR = maxValue[0], maxG = maxValue[1], maxB = maxValue[2];
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < width; i++) {
+            minR = min(minR, p[i].r); maxR = max(maxR, p[i].r);
+            minG = min(minG, p[i].g); maxG = max(maxG, p[i].g);
+            minB = min(minB, p[i].b); maxB = max(maxB, p[i].b);
+        }
+    }
+    minValue[0] = minR; minValue[1] = minG; minValue[2] = minB;
+    maxValue[0] = maxR; maxValue[1] = maxG; maxValue[2] = maxB;
+}
+
+inline void absDiffScalar(const Pixel* p, size_t stride, int width, int rows, Pixel center, uint64_t sad[3]) {
+    uint64_t r = 0, g = 0, b = 0;
+    for (int j = 0; j < rows; j++, p = nextRow(p, stride)) {
+        for (int i = 0; i < width; i++) {
+            r += abs(p[i].r - center.r);
+            g += abs(p[i].g - center.g);
+            b += abs(p[i].b - center.b);
+        }
+    }
+    sad[0] += r;
+    sad[1] += g;
+    sad[2] += b;
+}
+
+// Best kernels for this CPU (AVX2, SSE4.1 or scalar), detected once at first use
+const PixelKernels& pixelKernels();
+// Reference for checking the others against
+const PixelKernels& scalarPixelKernels();
+// Every kernel set this CPU can run, scalar first
+vector<const PixelKernels*> supportedPixelKernels();
+
+#endif // SIMD_H
@@ -0,0 +1,112 @@
+#include "threadpool.h"
+
+using namespace std;
+
+// Identity of the calling thread when it is a pool worker
+static thread_local const ThreadPool* workerPool = nullptr;
+static thread_local int workerIndex = 0;
+
+ThreadPool::ThreadPool(int threads) : queued_(0), stopping_(false) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    for (int i = 0; i < threads; i++) {
+        queues_.emplace_back(new WorkQueue());
+    }
+    for (int i = 1; i < threads; i++) {
+        workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(sleepMutex_);
+        stopping_ = true;
+    }
+    sleepCv_.notify_all();
+    for (thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+int ThreadPool::currentWorker() const {
+    return workerPool == this ? workerIndex : 0;
+}
+
+void ThreadPool::submit(function<void()> task) {
+    WorkQueue& queue = *queues_[currentWorker()];
+    {
+        lock_guard<mutex> lock(queue.lock);
+        queue.tasks.push_back(move(task));
+    }
+    queued_++;
+
+    // Taking the sleep lock orders this push before any worker's predicate check
+    { lock_guard<mutex> lock(sleepMutex_); }
+    sleepCv_.notify_one();
+}
+
+bool ThreadPool::runPending() {
+    const int self = currentWorker();
+    function<void()> task;
+
+    // Own deque first, newest task (LIFO)
+    {
+        WorkQueue& queue = *queues_[self];
+        lock_guard<mutex> lock(queue.lock);
+        if (!queue.tasks.empty()) {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+    }
+
+    // Otherwise steal the oldest task of another deque (FIFO), which tends to be the largest
+    for (int i = 1; !task && i < size(); i++) {
+        WorkQueue& victim = *queues_[(self + i) % size()];
+        lock_guard<mutex> lock(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    if (!task) {
+        return false;
+    }
+
+    queued_--;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(int index) {
+    workerPool = this;
+    workerIndex = index;
+    while (true) {
+        if (runPending()) {
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleepMutex_);
+        sleepCv_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        if (stopping_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+void TaskGroup::run(function<void()> task) {
+    pending_++;
+    pool_.submit([this, task]() {
+        task();
+        pending_--;
+    });
+}
+
+void TaskGroup::wait() {
+    while (pending_ > 0) {
+        if (!pool_.runPending()) {
+            this_thread::yield();
+        }
+    }
+}
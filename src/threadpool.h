@@ -0,0 +1,70 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+using namespace std;
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops
+// its own tasks at the back (LIFO, good locality for recursive splits) and
+// idle workers steal from the front of other deques. Threads that are not
+// part of the pool share slot 0 and help run tasks while they wait.
+class ThreadPool {
+public:
+    // threads counts the calling thread, so ThreadPool(4) starts 3 workers
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)queues_.size(); }
+
+    void submit(function<void()> task);
+
+    // Run one queued task if there is any, returns false when all deques are empty
+    bool runPending();
+
+    // Slot of the calling thread: 1..size()-1 for this pool's workers, 0 for everyone else
+    int currentWorker() const;
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    void workerLoop(int index);
+
+    vector<unique_ptr<WorkQueue>> queues_;
+    vector<thread> workers_;
+    atomic<int> queued_;
+    mutex sleepMutex_;
+    condition_variable sleepCv_;
+    bool stopping_;
+};
+
+// A set of tasks that can be waited on together. wait() keeps the waiting
+// thread busy with pending tasks instead of blocking, so nested groups
+// (a task that forks and waits for its own subtasks) cannot deadlock.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool_(pool), pending_(0) {}
+    ~TaskGroup() { wait(); }
+
+    void run(function<void()> task);
+    void wait();
+
+private:
+    ThreadPool& pool_;
+    atomic<int> pending_;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,182 @@
+#include "threshold.h"
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <cstdlib>
+
+using namespace std;
+
+// Record a block and all its sub-blocks down to the minimum block size
+static void indexBlock(ThresholdIndex& index, const Image& image, const IntegralImage* integral, int x, int y, int size, int minBlockSize, int method) {
+    size_t self = index.entries.size();
+    index.entries.push_back(ThresholdIndex::Entry());
+
+    Pixel avgColor;
+    double error = calculateBlockError(image, x, y, size, method, integral, avgColor);
+    bool canSplit = size > minBlockSize && size / 2 >= minBlockSize;
+
+    if (canSplit) {
+        int halfSize = size / 2;
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        for (int i = 0; i < 4; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            if (index.contains(cx, cy)) {
+                indexBlock(index, image, integral, cx, cy, halfSize, minBlockSize, method);
+            }
+        }
+    }
+
+    ThresholdIndex::Entry& entry = index.entries[self];
+    entry.error = error;
+    entry.avgColor = avgColor;
+    entry.canSplit = canSplit;
+    entry.subtreeSize = index.entries.size() - self;
+}
+
+// Same entries for Entropy, whose per-block cost would otherwise be a
+// histogram of the whole block at every level. Quadrants are indexed first
+// and a block's histogram is the merge of theirs, so pixels are read only at
+// the minimum block size and every other block costs O(distinct values).
+// quadrants holds one reusable slot set per depth. (MAD could be answered
+// the same way, but its SIMD scan around the summed-area mean is faster.)
+static void indexBlockMerged(ThresholdIndex& index, const Image& image, vector<array<BlockSummary, 4>>& quadrants, int x, int y, int size, int depth, int minBlockSize, int method, BlockSummary& summary) {
+    size_t self = index.entries.size();
+    index.entries.push_back(ThresholdIndex::Entry());
+
+    bool canSplit = size > minBlockSize && size / 2 >= minBlockSize;
+    summary.parts = BlockSummary::partsFor(method);
+
+    if (canSplit) {
+        int halfSize = size / 2;
+        array<BlockSummary, 4>& parts = quadrants[depth];
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        summary.clear(summary.parts);
+        for (int i = 0; i < 4; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            if (index.contains(cx, cy)) {
+                indexBlockMerged(index, image, quadrants, cx, cy, halfSize, depth + 1, minBlockSize, method, parts[i]);
+                summary.merge(parts[i]);
+            }
+        }
+    } else {
+        calculateBlockSummary(image, x, y, size, summary);
+    }
+
+    ThresholdIndex::Entry& entry = index.entries[self];
+    entry.avgColor = calculateAvgColor(summary);
+    entry.error = calculateError(summary, entry.avgColor, method);
+    entry.canSplit = canSplit;
+    entry.subtreeSize = index.entries.size() - self;
+}
+
+// Key of every non-root block: the smallest error among its ancestors
+static void collectKeys(ThresholdIndex& index, size_t pos, double ancestorMin) {
+    const ThresholdIndex::Entry& entry = index.entries[pos];
+    if (pos != 0) {
+        index.keys.push_back(ancestorMin);
+    }
+    double childMin = min(ancestorMin, entry.error);
+    for (size_t child = pos + 1; child < pos + entry.subtreeSize; child += index.entries[child].subtreeSize) {
+        collectKeys(index, child, childMin);
+    }
+}
+
+// Single full-depth pass over the image
+ThresholdIndex buildThresholdIndex(const Image& image, int size, int minBlockSize, int method, const IntegralImage* integral) {
+    ThresholdIndex index;
+    index.size = size;
+    index.width = image.width();
+    index.height = image.height();
+    if (method == 4) {
+        int levels = 1;
+        for (int s = size; s > 1; s /= 2) {
+            levels++;
+        }
+        vector<array<BlockSummary, 4>> quadrants(levels);
+        BlockSummary rootSummary;
+        indexBlockMerged(index, image, quadrants, 0, 0, size, 0, minBlockSize, method, rootSummary);
+    } else {
+        indexBlock(index, image, integral, 0, 0, size, minBlockSize, method);
+    }
+    TraceScope scope("sort keys");
+    collectKeys(index, 0, numeric_limits<double>::infinity());
+    sort(index.keys.begin(), index.keys.end());
+    return index;
+}
+
+// Root plus every block whose ancestors all have an error above the threshold
+size_t countNodesAtThreshold(const ThresholdIndex& index, double threshold) {
+    if (index.entries.empty()) return 0;
+    size_t kept = index.keys.end() - upper_bound(index.keys.begin(), index.keys.end(), threshold);
+    return 1 + kept;
+}
+
+// The node count only changes at recorded key values, so those (plus 0, the
+// smallest meaningful threshold) are the only candidates worth trying.
+// Counts shrink as the threshold grows: bisect for the first candidate at
+// or below the target and compare it with its neighbour.
+double findThresholdForNodeCount(const ThresholdIndex& index, size_t targetNodes) {
+    const vector<double>& keys = index.keys;
+    auto candidate = [&](size_t i) { return i == 0 ? 0.0 : keys[i - 1]; };
+
+    size_t lo = 0, hi = keys.size() + 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (countNodesAtThreshold(index, candidate(mid)) <= targetNodes) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    if (lo == keys.size() + 1) {
+        return candidate(keys.size());
+    }
+    if (lo == 0) {
+        return candidate(0);
+    }
+
+    double above = candidate(lo - 1), below = candidate(lo);
+    size_t aboveCount = countNodesAtThreshold(index, above);
+    size_t belowCount = countNodesAtThreshold(index, below);
+    return aboveCount - targetNodes < targetNodes - belowCount ? above : below;
+}
+
+// Walk the recorded pre-order, skipping whole subtrees of blocks that stay leaves
+static QuadTreeNode* buildFromEntry(const ThresholdIndex& index, size_t pos, NodeArena& arena, int x, int y, int size, int depth, double threshold, TreeStats& stats) {
+    const ThresholdIndex::Entry& entry = index.entries[pos];
+    QuadTreeNode* node = arena.create(x, y, size);
+    node->avgColor = entry.avgColor;
+    bool split = entry.error > threshold && entry.canSplit;
+    stats.add(depth, !split);
+
+    if (split) {
+        node->isLeaf = false;
+        int halfSize = size / 2;
+
+        size_t child = pos + 1;
+        const int offsets[4][2] = {{0, 0}, {halfSize, 0}, {0, halfSize}, {halfSize, halfSize}};
+        for (int i = 0; i < 4; i++) {
+            int cx = x + offsets[i][0], cy = y + offsets[i][1];
+            if (index.contains(cx, cy)) {
+                node->children[i] = buildFromEntry(index, child, arena, cx, cy, halfSize, depth + 1, threshold, stats);
+                child += index.entries[child].subtreeSize;
+            }
+        }
+    }
+
+    return node;
+}
+
+// Same tree buildQuadTree would produce for this threshold, without any pixel access
+void buildQuadTreeFromIndex(QuadTree& tree, const ThresholdIndex& index, double threshold) {
+    tree.clear();
+    if (tree.arenas.empty()) {
+        tree.arenas.emplace_back();
+    }
+    if (!index.entries.empty()) {
+        tree.root = buildFromEntry(index, 0, tree.arenas[0], 0, 0, index.size, 0, threshold, tree.stats);
+    }
+    traceCount(TRACE_NODES_CREATED, tree.stats.nodes);
+}
@@ -0,0 +1,41 @@
+#ifndef THRESHOLD_H
+#define THRESHOLD_H
+
+#include <vector>
+#include <cstdint>
+#include "quadtree.h"
+
+using namespace std;
+
+// Errors of every block of a full-depth quadtree, recorded once so that any
+// threshold can be evaluated without touching the pixels again.
+//
+// A block is part of the tree built with threshold t exactly when every one
+// of its ancestors has an error above t. keys holds, for every non-root
+// block, the smallest error among its ancestors, sorted ascending, so the
+// node count for any threshold is a binary search.
+struct ThresholdIndex {
+    struct Entry {
+        double error;
+        Pixel avgColor;
+        bool canSplit;         // Large enough to split at all (minimum block size)
+        uint32_t subtreeSize;  // Entries in this block's subtree, itself included
+    };
+
+    int size = 0;           // Root block size
+    int width = 0, height = 0;
+    vector<Entry> entries;  // Pre-order: block, then its NW, NE, SW, SE subtrees (those inside the image)
+    vector<double> keys;
+
+    // Quadrants past the image edge have no entry, as they have no node
+    bool contains(int x, int y) const { return x < width && y < height; }
+};
+
+ThresholdIndex buildThresholdIndex(const Image& image, int size, int minBlockSize, int method, const IntegralImage* integral = nullptr);
+size_t countNodesAtThreshold(const ThresholdIndex& index, double threshold);
+// Threshold whose tree has the node count closest to targetNodes
+double findThresholdForNodeCount(const ThresholdIndex& index, size_t targetNodes);
+// Rebuild the tree for a threshold from the recorded errors alone
+void buildQuadTreeFromIndex(QuadTree& tree, const ThresholdIndex& index, double threshold);
+
+#endif // THRESHOLD_H
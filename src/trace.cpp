@@ -0,0 +1,182 @@
+#include "trace.h"
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <array>
+#include <functional>
+
+using namespace std;
+
+atomic<bool> traceEnabled(false);
+
+struct TraceEvent {
+    const char* name;
+    string detail;
+    double start, duration; // Microseconds since startTrace()
+    uint64_t counters[TRACE_COUNTER_COUNT]; // This thread's counters when the event ended
+};
+
+// Events and counters of one thread. Only the owner writes; writeTrace
+// reads the events under the lock and the counters with relaxed loads.
+struct ThreadTrace {
+    int id;
+    mutex lock;
+    vector<TraceEvent> events;
+    atomic<uint64_t> counters[TRACE_COUNTER_COUNT];
+};
+
+static mutex registryMutex;
+static vector<unique_ptr<ThreadTrace>> threads; // Never shrinks, so thread_local pointers stay valid
+static chrono::steady_clock::time_point traceStart;
+static thread_local ThreadTrace* currentThread = nullptr;
+
+static ThreadTrace& threadTrace() {
+    if (!currentThread) {
+        lock_guard<mutex> lock(registryMutex);
+        threads.emplace_back(new ThreadTrace());
+        currentThread = threads.back().get();
+        currentThread->id = (int)threads.size();
+        for (auto& counter : currentThread->counters) {
+            counter.store(0, memory_order_relaxed);
+        }
+    }
+    return *currentThread;
+}
+
+static double microsecondsSinceStart(chrono::steady_clock::time_point time) {
+    return chrono::duration<double, micro>(time - traceStart).count();
+}
+
+static string jsonEscape(const string& value) {
+    string out;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void startTrace() {
+    traceStart = chrono::steady_clock::now();
+    threadTrace(); // The caller gets id 1
+    traceEnabled.store(true, memory_order_relaxed);
+}
+
+void traceAdd(TraceCounter counter, uint64_t amount) {
+    // Single writer per slot: a plain load and store, no locked add
+    atomic<uint64_t>& slot = threadTrace().counters[counter];
+    slot.store(slot.load(memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void TraceScope::finish() {
+    auto end = chrono::steady_clock::now();
+    TraceEvent event;
+    event.name = name_;
+    event.detail = move(detail_);
+    event.start = microsecondsSinceStart(start_);
+    event.duration = chrono::duration<double, micro>(end - start_).count();
+
+    // Only this thread's counters: the totals across threads are summed
+    // by writeTrace, so ending a scope never touches another thread
+    ThreadTrace& trace = threadTrace();
+    for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+        event.counters[i] = trace.counters[i].load(memory_order_relaxed);
+    }
+    lock_guard<mutex> lock(trace.lock);
+    trace.events.push_back(move(event));
+}
+
+// One counter sample ("C") per counter group at time ts
+static void writeCounterSample(ofstream& file, const function<ofstream&()>& separator, double ts,
+                               const uint64_t totals[TRACE_COUNTER_COUNT]) {
+    static const char* COUNTER_NAMES[TRACE_COUNTER_COUNT] = {
+        "pixels scanned", "nodes created", "variance", "mad", "max difference", "entropy", "bytes written"};
+
+    separator() << "{\"name\": \"metric calls\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << ts << ", \"args\": {";
+    for (int i = TRACE_METRIC_VARIANCE; i <= TRACE_METRIC_ENTROPY; i++) {
+        file << (i == TRACE_METRIC_VARIANCE ? "" : ", ") << "\"" << COUNTER_NAMES[i] << "\": " << totals[i];
+    }
+    file << "}}";
+    for (int i : {TRACE_PIXELS_SCANNED, TRACE_NODES_CREATED, TRACE_BYTES_WRITTEN}) {
+        separator() << "{\"name\": \"" << COUNTER_NAMES[i] << "\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << ts
+                    << ", \"args\": {\"total\": " << totals[i] << "}}";
+    }
+}
+
+// Complete events ("X") for the scopes, then one counter sample per scope
+// end so the counters plot as running totals under the timeline, and a
+// last sample with everything counted up to now
+bool writeTrace(const string& filename) {
+    ofstream file(filename);
+    if (!file) {
+        return false;
+    }
+
+    lock_guard<mutex> registryLock(registryMutex);
+    file << fixed << setprecision(3);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    function<ofstream&()> separator = [&]() -> ofstream& {
+        file << (first ? "  " : ",\n  ");
+        first = false;
+        return file;
+    };
+
+    struct Sample {
+        double end;
+        size_t thread;
+        const TraceEvent* event;
+    };
+    vector<Sample> samples;
+    for (size_t t = 0; t < threads.size(); t++) {
+        ThreadTrace& thread = *threads[t];
+        separator() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread.id
+                    << ", \"args\": {\"name\": \"" << (thread.id == 1 ? "main" : "worker") << "\"}}";
+
+        lock_guard<mutex> lock(thread.lock);
+        for (const TraceEvent& event : thread.events) {
+            separator() << "{\"name\": \"" << jsonEscape(event.name) << "\", \"cat\": \"stage\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                        << thread.id << ", \"ts\": " << event.start << ", \"dur\": " << event.duration;
+            if (!event.detail.empty()) {
+                file << ", \"args\": {\"detail\": \"" << jsonEscape(event.detail) << "\"}";
+            }
+            file << "}";
+            samples.push_back({event.start + event.duration, t, &event});
+        }
+    }
+
+    // Counter samples must be in time order to plot as steps. Each event
+    // holds its own thread's counters, so the total is the sum of every
+    // thread's latest snapshot, kept up to date one event at a time.
+    stable_sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.end < b.end; });
+    vector<array<uint64_t, TRACE_COUNTER_COUNT>> latest(threads.size(), array<uint64_t, TRACE_COUNTER_COUNT>{});
+    uint64_t totals[TRACE_COUNTER_COUNT] = {};
+    for (const Sample& sample : samples) {
+        for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+            totals[i] += sample.event->counters[i] - latest[sample.thread][i];
+            latest[sample.thread][i] = sample.event->counters[i];
+        }
+        writeCounterSample(file, separator, sample.end, totals);
+    }
+
+    // Counts made after a thread's last scope ended
+    fill(totals, totals + TRACE_COUNTER_COUNT, 0);
+    for (const auto& thread : threads) {
+        for (int i = 0; i < TRACE_COUNTER_COUNT; i++) {
+            totals[i] += thread->counters[i].load(memory_order_relaxed);
+        }
+    }
+    writeCounterSample(file, separator, microsecondsSinceStart(chrono::steady_clock::now()), totals);
+
+    file << "\n]}\n";
+    return file.good();
+}
@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+// Scoped stage timers and counters, written as a Chrome trace-event JSON file
+// (chrome://tracing, Perfetto). Nothing is recorded until startTrace(); until
+// then a TraceScope or traceCount costs one relaxed load and a branch.
+//
+// Every thread records into its own buffer, so the build and reconstruction
+// workers never contend; the buffers are only gathered by writeTrace().
+
+enum TraceCounter {
+    TRACE_PIXELS_SCANNED,  // Pixels read by the block metrics
+    TRACE_NODES_CREATED,   // Nodes of the trees built
+    TRACE_METRIC_VARIANCE, // Block metric evaluations, one counter per method
+    TRACE_METRIC_MAD,
+    TRACE_METRIC_MAXDIFF,
+    TRACE_METRIC_ENTROPY,
+    TRACE_BYTES_WRITTEN,   // Bytes of output files
+    TRACE_COUNTER_COUNT
+};
+
+extern atomic<bool> traceEnabled;
+
+inline bool tracing() {
+    return traceEnabled.load(memory_order_relaxed);
+}
+
+// Begin recording; the calling thread is labelled "main"
+void startTrace();
+
+// Write everything recorded so far, false if the file cannot be written
+bool writeTrace(const string& filename);
+
+void traceAdd(TraceCounter counter, uint64_t amount);
+
+inline void traceCount(TraceCounter counter, uint64_t amount = 1) {
+    if (tracing()) traceAdd(counter, amount);
+}
+
+// Metric counter of an error method (1-4)
+inline void traceMetric(int method, uint64_t pixels) {
+    if (tracing()) {
+        traceAdd((TraceCounter)(TRACE_METRIC_VARIANCE + (method >= 1 && method <= 4 ? method - 1 : 0)), 1);
+        if (pixels) traceAdd(TRACE_PIXELS_SCANNED, pixels);
+    }
+}
+
+// A complete event spanning the lifetime of the object. name must outlive
+// the trace (a string literal); detail, if any, is copied.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name_(name), active_(tracing()) {
+        if (active_) start_ = chrono::steady_clock::now();
+    }
+    TraceScope(const char* name, const string& detail) : name_(name), active_(tracing()) {
+        if (active_) {
+            detail_ = detail;
+            start_ = chrono::steady_clock::now();
+        }
+    }
+    ~TraceScope() {
+        if (active_) finish();
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    void finish();
+
+    const char* name_;
+    string detail_;
+    bool active_;
+    chrono::steady_clock::time_point start_;
+};
+
+#endif // TRACE_H
@@ -0,0 +1,71 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <filesystem>
+#include "image.h"
+
+using namespace std;
+
+// Regression checks for inputs that once crashed the program. Each case
+// writes a small file, runs it through every reader and expects a clean
+// failure (or success); the exit status is 1 when any case does not hold.
+//
+//   g++ -O2 -std=c++17 -pthread -Isrc test/regression.cpp $(ls src/*.cpp | grep -v main.cpp) -o bin/regression
+
+static int failures = 0;
+
+static void expect(bool condition, const string& what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+static string writeFile(const string& name, const string& contents) {
+    string path = (filesystem::temp_directory_path() / ("quadtree_regression_" + name)).string();
+    ofstream file(path, ios::binary);
+    file << contents;
+    return path;
+}
+
+// Every way the pixels of a PPM/PAM are opened must refuse the file
+static void expectRejected(const string& name, const string& contents) {
+    string path = writeFile(name, contents);
+    PpmReader reader;
+    expect(mapImage(path).empty(), name + ": mapImage");
+    expect(loadImage(path).empty(), name + ": loadImage");
+    expect(!reader.open(path), name + ": PpmReader");
+    filesystem::remove(path);
+}
+
+static void expectLoaded(const string& name, const string& contents, int width, int height) {
+    string path = writeFile(name, contents);
+    Image image = mapImage(path);
+    expect(!image.empty() && image.width() == width && image.height() == height, name + ": mapImage");
+    expect(!image.empty() && image.row(height - 1)[width - 1].b == (unsigned char)contents.back(), name + ": last pixel");
+    filesystem::remove(path);
+}
+
+int main() {
+    // Header ending at EOF: once mapped with an offset of -1
+    expectRejected("eof.ppm", "P6 1 1 255");
+    expectRejected("eof-comment.ppm", "P6 1 1\n# comment\n255");
+    expectRejected("eof.pam", "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nENDHDR");
+    // Complete header, pixels missing or short
+    expectRejected("no-pixels.ppm", "P6 1 1 255\n");
+    expectRejected("short.ppm", "P6 2 2 255\n" + string(11, 'x'));
+    expectRejected("short.pam", "P7\nWIDTH 2\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nENDHDR\nabcde");
+    // Sizes whose byte count must not wrap the bounds check
+    expectRejected("huge.ppm", "P6 2147483647 2147483647 255\n" + string(3, 'x'));
+
+    expectLoaded("one.ppm", "P6 1 1 255\nabc", 1, 1);
+    expectLoaded("comment.ppm", "P6\n# made by hand\n2 1\n255\nabcdef", 2, 1);
+    expectLoaded("one.pam", "P7\nWIDTH 1\nHEIGHT 1\nDEPTH 3\nMAXVAL 255\nTUPLTYPE RGB\nENDHDR\nabc", 1, 1);
+
+    if (failures > 0) {
+        cerr << failures << " check(s) failed" << endl;
+        return 1;
+    }
+    cout << "All regression checks passed" << endl;
+    return 0;
+}
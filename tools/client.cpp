@@ -0,0 +1,145 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <sys/un.h>
+#include "protocol.h"
+
+using namespace std;
+
+// Test client for quadtree --serve.
+//
+//   client SOCKET -i image.jpg -o out.qtc -m 2 -t 5
+//   client SOCKET --send image.jpg -o out.png --format png --repeat 10
+//   client SOCKET --shutdown
+//
+// -i lets the server read the file itself; --send transmits its contents.
+// With --repeat the same request is sent N times on one connection and the
+// time of each round trip is printed, which shows the server warming up.
+
+static void printUsage(const char* program) {
+    cout << "Usage: " << program << " SOCKET [options]" << endl;
+    cout << "  -i, --input PATH       image (or .qtc) the server reads from its own disk" << endl;
+    cout << "      --send PATH        send the contents of PATH instead" << endl;
+    cout << "  -o, --output PATH      write the returned output to PATH" << endl;
+    cout << "      --format EXT       output type: qtc (default), png, jpg or bmp" << endl;
+    cout << "  -m, --method N         error method 1-4" << endl;
+    cout << "  -t, --threshold X      error threshold" << endl;
+    cout << "  -b, --min-block N      minimum block size" << endl;
+    cout << "      --target X         target compression 0.0-1.0" << endl;
+    cout << "      --bottom-up        build from the smallest blocks upwards" << endl;
+    cout << "      --max-depth N      image of the tree cut at depth N" << endl;
+    cout << "      --repeat N         send the request N times and time each reply" << endl;
+    cout << "      --ping             only check that the server answers" << endl;
+    cout << "      --shutdown         stop the server" << endl;
+}
+
+static bool readFile(const string& path, vector<unsigned char>& data) {
+    ifstream file(path, ios::binary);
+    if (!file) return false;
+    data.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || string(argv[1]) == "-h" || string(argv[1]) == "--help") {
+        printUsage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    const string socketPath = argv[1];
+
+    Message request;
+    request.command = "COMPRESS";
+    string outputPath = "";
+    int repeat = 1;
+    for (int i = 2; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if ((arg == "-i" || arg == "--input") && hasValue) {
+            request.add("input", argv[++i]);
+        } else if (arg == "--send" && hasValue) {
+            if (!readFile(argv[++i], request.payload)) {
+                cerr << "Error: Could not read " << argv[i] << endl;
+                return 1;
+            }
+        } else if ((arg == "-o" || arg == "--output") && hasValue) {
+            outputPath = argv[++i];
+        } else if (arg == "--format" && hasValue) {
+            request.add("format", argv[++i]);
+        } else if ((arg == "-m" || arg == "--method") && hasValue) {
+            request.add("method", argv[++i]);
+        } else if ((arg == "-t" || arg == "--threshold") && hasValue) {
+            request.add("threshold", argv[++i]);
+        } else if ((arg == "-b" || arg == "--min-block") && hasValue) {
+            request.add("min-block", argv[++i]);
+        } else if (arg == "--target" && hasValue) {
+            request.add("target", argv[++i]);
+        } else if (arg == "--bottom-up") {
+            request.add("bottom-up", "1");
+        } else if (arg == "--max-depth" && hasValue) {
+            request.add("max-depth", argv[++i]);
+        } else if (arg == "--repeat" && hasValue) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if (arg == "--ping") {
+            request.command = "PING";
+        } else if (arg == "--shutdown") {
+            request.command = "SHUTDOWN";
+        } else {
+            cerr << "Error: unknown or incomplete option " << arg << endl;
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: socket path too long" << endl;
+        return 1;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        cerr << "Error: Could not connect to " << socketPath << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    Message reply;
+    for (int run = 0; run < repeat; run++) {
+        auto start = chrono::steady_clock::now();
+        if (!writeMessage(connection, request) || !readMessage(connection, reply)) {
+            cerr << "Error: the server closed the connection" << endl;
+            close(connection);
+            return 1;
+        }
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        if (repeat > 1) {
+            cout << "Request " << (run + 1) << ": " << elapsed.count() << " ms" << endl;
+        }
+    }
+    close(connection);
+
+    if (reply.command != "OK") {
+        cerr << "Error: " << reply.get("message", reply.command) << endl;
+        return 1;
+    }
+    for (const auto& field : reply.fields) {
+        if (field.first == "report") cout << field.second << endl;
+    }
+
+    if (!outputPath.empty()) {
+        ofstream file(outputPath, ios::binary);
+        file.write(reinterpret_cast<const char*>(reply.payload.data()), reply.payload.size());
+        if (!file) {
+            cerr << "Error: Could not write " << outputPath << endl;
+            return 1;
+        }
+        cout << "Reply (" << reply.payload.size() << " bytes) saved to: " << outputPath << endl;
+    }
+    return 0;
+}